@@ -8,6 +8,8 @@
 extern struct bus_type ldd_bus_type;
 
 
+struct ldd_device;
+
 /*
  * The LDD driver type.
  */
@@ -17,6 +19,21 @@ struct ldd_driver {
 	struct module *module;
 	struct device_driver driver;
 	struct driver_attribute version_attr;
+	/*
+	 * Optional, for runtime creation of devices through
+	 * /sys/bus/ldd/new_device ("<driver> [args]") and
+	 * /sys/bus/ldd/delete_device ("<device name>").
+	 */
+	int (*new_device)(struct ldd_driver *, const char *args);
+	int (*delete_device)(struct ldd_driver *, const char *name);
+	/*
+	 * Optional, runtime power management: called by the bus when the
+	 * device goes idle (see pm_runtime_*()) and when it is needed
+	 * again.
+	 */
+	int (*runtime_suspend)(struct ldd_device *);
+	int (*runtime_resume)(struct ldd_device *);
+	u32 match_key;		/* cached at registration for ldd_match */
 };
 
 #define to_ldd_driver(drv) container_of(drv, struct ldd_driver, driver);
@@ -29,11 +46,14 @@ struct ldd_device {
 	char *name;
 	struct ldd_driver *driver;
 	struct device dev;
+	struct hlist_node hnode;	/* in the bus name table */
 };
 
 #define to_ldd_device(dev) container_of(dev, struct ldd_device, dev);
 
 extern int register_ldd_device(struct ldd_device *);
+extern int register_ldd_devices(struct ldd_device **, int n);
 extern void unregister_ldd_device(struct ldd_device *);
+extern struct ldd_device *ldd_find_device(const char *name);
 extern int register_ldd_driver(struct ldd_driver *);
 extern void unregister_ldd_driver(struct ldd_driver *);
@@ -21,35 +21,184 @@
 #include <linux/kernel.h>
 #include <linux/init.h>
 #include <linux/string.h>
+#include <linux/hashtable.h>
+#include <linux/stringhash.h>
+#include <linux/spinlock.h>
+#include <linux/slab.h>
+#include <linux/async.h>
+#include <linux/cpumask.h>
+#include <linux/moduleparam.h>
+#include <linux/workqueue.h>
+#include <linux/jiffies.h>
+#include <linux/pm_runtime.h>
 #include "lddbus.h"
 
 MODULE_AUTHOR("Jonathan Corbet");
 MODULE_LICENSE("Dual BSD/GPL");
 static char *Version = "$Revision: 1.9 $";
 
+/*
+ * Probe drivers that don't say otherwise asynchronously, so that the
+ * probing of many devices overlaps and module init does not wait.
+ */
+static int async_probe = 0;
+module_param(async_probe, int, S_IRUGO);
+
+extern struct device ldd_bus;
+
+/*
+ * Uevent coalescing. With a window set (in ms, through the bus
+ * attribute uevent_window_ms), the first add or remove goes out as
+ * usual and opens the window; the adds and removes that follow in it
+ * are held back and counted, and a single "change" event on the bus
+ * itself (/sys/bus/ldd, SUBSYSTEM=bus) reports them when it closes
+ * (LDDBUS_ADDED=, LDDBUS_REMOVED=). Not on ldd0: that one has neither
+ * bus nor class, and the device core filters its events out. While
+ * the burst goes on, one summary goes out per window. Listeners are
+ * expected to rescan /sys/bus/ldd/devices on a summary.
+ */
+static unsigned int ldd_uevent_window;		/* ms, 0: off */
+static DEFINE_SPINLOCK(ldd_uevent_lock);
+static int ldd_uevent_burst;			/* a window is open */
+static unsigned int ldd_uevent_added, ldd_uevent_removed;
+
+static void ldd_uevent_flush(struct work_struct *work);
+static DECLARE_DELAYED_WORK(ldd_uevent_work, ldd_uevent_flush);
+
+static void ldd_uevent_flush(struct work_struct *work)
+{
+	char added[32], removed[32];
+	char *envp[] = { "LDDBUS_EVENT=summary", added, removed, NULL };
+	unsigned int nadd, nrem;
+
+	spin_lock(&ldd_uevent_lock);
+	nadd = ldd_uevent_added;
+	nrem = ldd_uevent_removed;
+	ldd_uevent_added = ldd_uevent_removed = 0;
+	if (nadd || nrem)	/* still busy: keep the window open */
+		schedule_delayed_work(&ldd_uevent_work,
+				msecs_to_jiffies(ldd_uevent_window));
+	else
+		ldd_uevent_burst = 0;
+	spin_unlock(&ldd_uevent_lock);
+
+	if (!nadd && !nrem)
+		return;
+	snprintf(added, sizeof(added), "LDDBUS_ADDED=%u", nadd);
+	snprintf(removed, sizeof(removed), "LDDBUS_REMOVED=%u", nrem);
+	kobject_uevent_env(&bus_get_kset(&ldd_bus_type)->kobj, KOBJ_CHANGE, envp);
+}
+
+/* The action, when the event is going out (not for the uevent file) */
+static const char *ldd_uevent_action(struct kobj_uevent_env *env)
+{
+	int i;
+
+	for (i = 0; i < env->envp_idx; i++)
+		if (!strncmp(env->envp[i], "ACTION=", 7))
+			return env->envp[i] + 7;
+	return NULL;
+}
+
+/* Returns nonzero if the event is to be held back */
+static int ldd_uevent_coalesce(struct kobj_uevent_env *env)
+{
+	const char *action;
+	int add, held = 0;
+
+	if (!ldd_uevent_window)
+		return 0;
+	action = ldd_uevent_action(env);
+	if (!action)
+		return 0;
+	add = !strcmp(action, "add");
+	if (!add && strcmp(action, "remove"))
+		return 0;
+
+	spin_lock(&ldd_uevent_lock);
+	if (!ldd_uevent_burst) {
+		ldd_uevent_burst = 1;
+		schedule_delayed_work(&ldd_uevent_work,
+				msecs_to_jiffies(ldd_uevent_window));
+	} else {
+		if (add)
+			ldd_uevent_added++;
+		else
+			ldd_uevent_removed++;
+		held = 1;
+	}
+	spin_unlock(&ldd_uevent_lock);
+	return held;
+}
+
 /*
  * Respond to hotplug events.
  */
 static int ldd_hotplug(struct device *dev, struct kobj_uevent_env *env)
 {
-	/**
-	 * Need to be considered
-	 */
+	/* an error return drops the event */
+	if (ldd_uevent_coalesce(env))
+		return -EAGAIN;
 	add_uevent_var(env, "LDDBUS_VERSION=%s", Version);
 	return 0;
 }
 
 /*
- * Match LDD devices to drivers.  Just do a simple name test.
+ * Devices and drivers match on the first four characters of their
+ * names. The key is computed once, at registration time, into dev->id
+ * and the driver's match_key, so a match is a single compare whatever
+ * the names. That only makes each compare cheap: the driver core still
+ * offers every device to every driver, so probing stays proportional
+ * to devices times drivers. The name table below is for lookups by
+ * name, not for matching.
  */
+static u32 ldd_match_key(const char *name)
+{
+	u32 key = 0;
+
+	strncpy((char *)&key, name, sizeof(key));
+	return key;
+}
+
 static int ldd_match(struct device *dev, struct device_driver *driver)
 {
-	/**
-	 * 
-	 *  driver->name --- sculld driver initialization
-	 */
-	return !strncmp((const char *)&dev->id, driver->name, 4);
+	struct ldd_driver *ldriver = to_ldd_driver(driver);
+
+	return dev->id == ldriver->match_key;
+}
+
+/*
+ * All registered devices, hashed by name, so that finding one does
+ * not walk the whole bus (bus_find_device_by_name does).
+ */
+#define LDD_HASH_BITS 10
+static DEFINE_HASHTABLE(ldd_devices, LDD_HASH_BITS);
+static DEFINE_SPINLOCK(ldd_devices_lock);
+
+static u32 ldd_name_hash(const char *name)
+{
+	return full_name_hash(NULL, name, strlen(name));
+}
+
+/*
+ * Look a device up by name; the caller gets a reference to drop
+ * with put_device().
+ */
+struct ldd_device *ldd_find_device(const char *name)
+{
+	struct ldd_device *ldev, *found = NULL;
+
+	spin_lock(&ldd_devices_lock);
+	hash_for_each_possible(ldd_devices, ldev, hnode, ldd_name_hash(name))
+		if (!strcmp(ldev->name, name)) {
+			found = ldev;
+			get_device(&found->dev);
+			break;
+		}
+	spin_unlock(&ldd_devices_lock);
+	return found;
 }
+EXPORT_SYMBOL(ldd_find_device);
 
 
 /*
@@ -75,6 +224,35 @@ struct device ldd_bus = {
 };
 
 
+/*
+ * Power management: hand runtime suspend and resume over to the
+ * driver the device belongs to. Devices whose driver has nothing to
+ * do just change state.
+ */
+static int ldd_runtime_suspend(struct device *dev)
+{
+	struct ldd_device *ldev = to_ldd_device(dev);
+	struct ldd_driver *ldriver = ldev->driver;
+
+	if (ldriver && ldriver->runtime_suspend)
+		return ldriver->runtime_suspend(ldev);
+	return 0;
+}
+
+static int ldd_runtime_resume(struct device *dev)
+{
+	struct ldd_device *ldev = to_ldd_device(dev);
+	struct ldd_driver *ldriver = ldev->driver;
+
+	if (ldriver && ldriver->runtime_resume)
+		return ldriver->runtime_resume(ldev);
+	return 0;
+}
+
+static const struct dev_pm_ops ldd_bus_pm_ops = {
+	SET_RUNTIME_PM_OPS(ldd_runtime_suspend, ldd_runtime_resume, NULL)
+};
+
 /*
  * And the bus type.
  */
@@ -83,6 +261,7 @@ struct bus_type ldd_bus_type = {
 	.match = ldd_match,
 	//.hotplug  = ldd_hotplug,
 	.uevent = ldd_hotplug,
+	.pm = &ldd_bus_pm_ops,
 };
 
 /*
@@ -95,6 +274,90 @@ static ssize_t show_bus_version(struct bus_type *bus, char *buf)
 
 static BUS_ATTR(version, S_IRUGO, show_bus_version, NULL);
 
+static ssize_t show_uevent_window(struct bus_type *bus, char *buf)
+{
+	return snprintf(buf, PAGE_SIZE, "%u\n", ldd_uevent_window);
+}
+
+static ssize_t store_uevent_window(struct bus_type *bus, const char *buf,
+		size_t count)
+{
+	unsigned int ms;
+
+	if (kstrtouint(buf, 0, &ms))
+		return -EINVAL;
+	ldd_uevent_window = ms;
+	return count;
+}
+
+static BUS_ATTR(uevent_window_ms, S_IRUGO | S_IWUSR, show_uevent_window,
+		store_uevent_window);
+
+/*
+ * Hotplug by hand: the driver named in the first word creates a
+ * device, passed whatever follows; or the driver owning the named
+ * device destroys it. The driver module is pinned during the call.
+ */
+static ssize_t store_new_device(struct bus_type *bus, const char *buf,
+		size_t count)
+{
+	struct device_driver *driver;
+	struct ldd_driver *ldriver;
+	char name[32];
+	int len, ret;
+
+	len = strcspn(buf, " \n");
+	if (!len || len >= sizeof(name))
+		return -EINVAL;
+	memcpy(name, buf, len);
+	name[len] = '\0';
+
+	driver = driver_find(name, &ldd_bus_type);
+	if (!driver)
+		return -ENODEV;
+	ldriver = to_ldd_driver(driver);
+	if (!ldriver->new_device)
+		return -EOPNOTSUPP;
+	if (!try_module_get(ldriver->module))
+		return -ENODEV;
+	ret = ldriver->new_device(ldriver, skip_spaces(buf + len));
+	module_put(ldriver->module);
+	return ret ? ret : count;
+}
+
+static BUS_ATTR(new_device, S_IWUSR, NULL, store_new_device);
+
+static ssize_t store_delete_device(struct bus_type *bus, const char *buf,
+		size_t count)
+{
+	struct ldd_device *ldev;
+	struct ldd_driver *ldriver;
+	char name[32];
+	int len, ret;
+
+	len = strcspn(buf, " \n");
+	if (!len || len >= sizeof(name))
+		return -EINVAL;
+	memcpy(name, buf, len);
+	name[len] = '\0';
+
+	ldev = ldd_find_device(name);
+	if (!ldev)
+		return -ENODEV;
+	ldriver = ldev->driver;
+	/* the driver looks it up again by name, under its own lock */
+	put_device(&ldev->dev);
+	if (!ldriver || !ldriver->delete_device)
+		return -EOPNOTSUPP;
+	if (!try_module_get(ldriver->module))
+		return -ENODEV;
+	ret = ldriver->delete_device(ldriver, name);
+	module_put(ldriver->module);
+	return ret ? ret : count;
+}
+
+static BUS_ATTR(delete_device, S_IWUSR, NULL, store_delete_device);
+
 
 
 /*
@@ -102,27 +365,111 @@ static BUS_ATTR(version, S_IRUGO, show_bus_version, NULL);
  */
 
 /*
- * For now, no references to LDDbus devices go out which are not
- * tracked via the module reference count, so we use a no-op
- * release function.
+ * Devices whose driver doesn't say otherwise are static, and only go
+ * away with their module: they get a no-op release function. A driver
+ * that allocates its devices sets dev.release before registering, and
+ * frees them there, when the last reference goes.
  */
 static void ldd_dev_release(struct device *dev)
 { }
 
+/*
+ * As with device_register, the device holds a reference from here on,
+ * even when registration fails: drop it with put_device() then.
+ */
 int register_ldd_device(struct ldd_device *ldddev)
 {
+	int ret;
+
+	device_initialize(&ldddev->dev);
 	ldddev->dev.bus = &ldd_bus_type;
 	ldddev->dev.parent = &ldd_bus;
-	ldddev->dev.release = ldd_dev_release;
+	if (!ldddev->dev.release)
+		ldddev->dev.release = ldd_dev_release;
 	//strncpy(dst, src, size) for safe string copy function
 	//strncpy(ldddev->dev.bus_id, ldddev->name, BUS_ID_SIZE);
-	ldddev->dev.id = *((u32 *)ldddev->name); // just assign the pointer of the ldddev name
-	return device_register(&ldddev->dev);
+	/* bus_id is gone: the name must be set, or device_add fails */
+	ret = dev_set_name(&ldddev->dev, "%s", ldddev->name);
+	if (ret)
+		return ret;
+	ldddev->dev.id = ldd_match_key(ldddev->name);
+	ret = device_add(&ldddev->dev);
+	if (ret)
+		return ret;
+	spin_lock(&ldd_devices_lock);
+	hash_add(ldd_devices, &ldddev->hnode, ldd_name_hash(ldddev->name));
+	spin_unlock(&ldd_devices_lock);
+	return 0;
 }
 EXPORT_SYMBOL(register_ldd_device);
 
+/*
+ * Register many devices at once. The array is cut in one slice per
+ * online CPU and the slices are registered in parallel, from the
+ * async thread pool; the call returns when all are on the bus. On
+ * error, none of them are left registered, and the one that failed
+ * has had its reference dropped already.
+ */
+struct ldd_batch {
+	struct ldd_device **devs;
+	int n;		/* in: slice size; out: how many made it */
+	int ret;
+};
+
+static ASYNC_DOMAIN_EXCLUSIVE(ldd_async_domain);
+
+static void ldd_register_slice(void *data, async_cookie_t cookie)
+{
+	struct ldd_batch *batch = data;
+	int i;
+
+	for (i = 0; i < batch->n; i++) {
+		batch->ret = register_ldd_device(batch->devs[i]);
+		if (batch->ret) {
+			put_device(&batch->devs[i]->dev);
+			break;
+		}
+	}
+	batch->n = i;
+}
+
+int register_ldd_devices(struct ldd_device **devs, int n)
+{
+	struct ldd_batch *batches;
+	int i, j, per, nslices, ret = 0;
+
+	if (n <= 0)
+		return 0;
+	nslices = min_t(int, num_online_cpus(), n);
+	batches = kcalloc(nslices, sizeof(*batches), GFP_KERNEL);
+	if (!batches)
+		return -ENOMEM;
+	per = DIV_ROUND_UP(n, nslices);
+	for (i = 0; i < nslices && i * per < n; i++) {
+		batches[i].devs = devs + i * per;
+		batches[i].n = min(per, n - i * per);
+		async_schedule_domain(ldd_register_slice, batches + i,
+				&ldd_async_domain);
+	}
+	async_synchronize_full_domain(&ldd_async_domain);
+
+	for (i = 0; i < nslices; i++)
+		if (batches[i].ret && !ret)
+			ret = batches[i].ret;
+	if (ret)
+		for (i = 0; i < nslices; i++)
+			for (j = 0; j < batches[i].n; j++)
+				unregister_ldd_device(batches[i].devs[j]);
+	kfree(batches);
+	return ret;
+}
+EXPORT_SYMBOL(register_ldd_devices);
+
 void unregister_ldd_device(struct ldd_device *ldddev)
 {
+	spin_lock(&ldd_devices_lock);
+	hash_del(&ldddev->hnode);
+	spin_unlock(&ldd_devices_lock);
 	device_unregister(&ldddev->dev);
 }
 EXPORT_SYMBOL(unregister_ldd_device);
@@ -146,6 +493,9 @@ int register_ldd_driver(struct ldd_driver *driver)
 	int ret;
 	
 	driver->driver.bus = &ldd_bus_type;
+	driver->match_key = ldd_match_key(driver->driver.name);
+	if (async_probe && driver->driver.probe_type == PROBE_DEFAULT_STRATEGY)
+		driver->driver.probe_type = PROBE_PREFER_ASYNCHRONOUS;
 	ret = driver_register(&driver->driver);
 	if (ret)
 		return ret;
@@ -184,6 +534,11 @@ static int __init ldd_bus_init(void)
 	 */
 	if (bus_create_file(&ldd_bus_type, &bus_attr_version))
 		printk(KERN_NOTICE "Unable to create version attribute\n");
+	if (bus_create_file(&ldd_bus_type, &bus_attr_new_device) ||
+	    bus_create_file(&ldd_bus_type, &bus_attr_delete_device))
+		printk(KERN_NOTICE "Unable to create hotplug attributes\n");
+	if (bus_create_file(&ldd_bus_type, &bus_attr_uevent_window_ms))
+		printk(KERN_NOTICE "Unable to create uevent_window_ms\n");
 	/**
 	 *  Why we need another one device register?
 	 *  That is because the lddbus is a device too.
@@ -199,6 +554,7 @@ static void ldd_bus_exit(void)
 	/**
 	 * Note the order to unregister of each attribute
 	 */
+	cancel_delayed_work_sync(&ldd_uevent_work);
 	device_unregister(&ldd_bus);
 	bus_unregister(&ldd_bus_type);
 }
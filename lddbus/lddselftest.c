@@ -0,0 +1,178 @@
+/*
+ * lddselftest.c -- time device probing on the LDD bus
+ *
+ * Registers "ndevs" devices (10000 by default) and a driver matching
+ * them, in both orders, and reports how long the bus takes to bind
+ * them all: devices coming in after the driver is the hotplug path,
+ * a driver coming in after its devices is the module load path.
+ * With this one driver on the bus both grow linearly with the number
+ * of devices; every other driver registered adds its own pass.
+ *
+ * With "batch" set, the devices go in through register_ldd_devices,
+ * in parallel; with "async" set the driver probes asynchronously.
+ * "probe_us" makes each probe sleep, like real hardware would, to
+ * show what the two buy.
+ *
+ * The devices stay registered until the module is removed, so they
+ * can be looked at in /sys/bus/ldd/devices.
+ *
+ * The source code in this file can be freely used, adapted,
+ * and redistributed in source or binary form, so long as an
+ * acknowledgment appears in derived source files.
+ */
+
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/init.h>
+#include <linux/kernel.h>
+#include <linux/device.h>
+#include <linux/vmalloc.h>
+#include <linux/ktime.h>
+#include <linux/atomic.h>
+#include <linux/delay.h>
+#include "lddbus.h"
+
+MODULE_AUTHOR("Jonathan Corbet");
+MODULE_LICENSE("Dual BSD/GPL");
+
+static int ndevs = 10000;
+module_param(ndevs, int, 0);
+static int batch = 0;
+module_param(batch, int, 0);
+static int async = 0;
+module_param(async, int, 0);
+static int probe_us = 0;
+module_param(probe_us, int, 0);
+
+#define LDST_NAME_LEN 16
+
+static struct ldd_device *ldst_devs;
+static struct ldd_device **ldst_ptrs;	/* for the batch API */
+static char (*ldst_names)[LDST_NAME_LEN];
+static int ldst_registered;	/* how many of ldst_devs are on the bus */
+static atomic_t ldst_probed = ATOMIC_INIT(0);
+
+static int ldst_probe(struct device *dev)
+{
+	if (probe_us > 0)
+		usleep_range(probe_us, probe_us + probe_us / 8 + 1);
+	atomic_inc(&ldst_probed);
+	return 0;
+}
+
+static struct ldd_driver ldst_driver = {
+	.version = "$Revision: 1.0 $",
+	.module = THIS_MODULE,
+	.driver = {
+		.name = "ldst",
+		.probe = ldst_probe,
+	},
+};
+
+static void ldst_report(const char *what, ktime_t start)
+{
+	s64 ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+	printk(KERN_INFO "lddselftest: %s: %d devices, %d probed, "
+			"%lld us, %lld ns/device\n", what, ldst_registered,
+			atomic_read(&ldst_probed), ns / 1000,
+			ldst_registered ? ns / ldst_registered : 0);
+}
+
+static void ldst_unregister_devs(void)
+{
+	while (ldst_registered > 0)
+		unregister_ldd_device(ldst_devs + --ldst_registered);
+}
+
+static int ldst_register_devs(void)
+{
+	int i, ret;
+
+	if (batch) {
+		ret = register_ldd_devices(ldst_ptrs, ndevs);
+		if (ret)
+			printk(KERN_NOTICE "lddselftest: batch: error %d\n", ret);
+		else
+			ldst_registered = ndevs;
+		return ret;
+	}
+	for (i = 0; i < ndevs; i++) {
+		ret = register_ldd_device(ldst_devs + i);
+		if (ret) {
+			printk(KERN_NOTICE "lddselftest: %s: error %d\n",
+					ldst_names[i], ret);
+			put_device(&ldst_devs[i].dev);
+			return ret;
+		}
+		ldst_registered++;
+	}
+	return 0;
+}
+
+static void ldst_cleanup(void)
+{
+	ldst_unregister_devs();
+	vfree(ldst_devs);
+	vfree(ldst_ptrs);
+	vfree(ldst_names);
+}
+
+static int __init ldst_init(void)
+{
+	ktime_t start;
+	int i, ret;
+
+	if (ndevs <= 0)
+		return -EINVAL;
+	ldst_devs = vzalloc(ndevs * sizeof(*ldst_devs));
+	ldst_ptrs = vzalloc(ndevs * sizeof(*ldst_ptrs));
+	ldst_names = vzalloc(ndevs * sizeof(*ldst_names));
+	if (!ldst_devs || !ldst_ptrs || !ldst_names) {
+		ret = -ENOMEM;
+		goto fail;
+	}
+	for (i = 0; i < ndevs; i++) {
+		snprintf(ldst_names[i], LDST_NAME_LEN, "ldst%d", i);
+		ldst_devs[i].name = ldst_names[i];
+		ldst_devs[i].driver = &ldst_driver;
+		ldst_ptrs[i] = ldst_devs + i;
+	}
+	if (async)
+		ldst_driver.driver.probe_type = PROBE_PREFER_ASYNCHRONOUS;
+
+	/* Driver first: every device is probed as it is added */
+	ret = register_ldd_driver(&ldst_driver);
+	if (ret)
+		goto fail;
+	start = ktime_get();
+	ret = ldst_register_devs();
+	wait_for_device_probe(); /* async probes count too */
+	ldst_report("devices after driver", start);
+	unregister_ldd_driver(&ldst_driver); /* unbinds them all */
+	if (ret)
+		goto fail;
+
+	/* Devices first: the driver scans the whole bus at registration */
+	atomic_set(&ldst_probed, 0);
+	start = ktime_get();
+	ret = register_ldd_driver(&ldst_driver);
+	wait_for_device_probe();
+	ldst_report("driver after devices", start);
+	if (ret)
+		goto fail;
+	return 0;
+
+  fail:
+	ldst_cleanup();
+	return ret;
+}
+
+static void __exit ldst_exit(void)
+{
+	ldst_cleanup();
+	unregister_ldd_driver(&ldst_driver);
+}
+
+module_init(ldst_init);
+module_exit(ldst_exit);
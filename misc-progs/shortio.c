@@ -0,0 +1,91 @@
+/*
+ * shortio.c -- port I/O throughput of the short device nodes
+ *
+ * Reads and writes "size" bytes through each node given (by default
+ * /dev/short0, /dev/short0p and /dev/short0s: the default, pausing
+ * and string modes; load short with use_mem=1 for the memory mode,
+ * which all nodes then use) and reports bytes per second for each.
+ * Writing goes to the parallel data latch: don't run it with a
+ * printer attached.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+
+static char *prog;
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* returns bytes per second, or -1 */
+static double run(const char *dev, int write_it, char *buf, size_t bufsize,
+                  unsigned long size)
+{
+    unsigned long done = 0;
+    double t0;
+    ssize_t n;
+    int fd;
+
+    fd = open(dev, write_it ? O_WRONLY : O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "%s: %s: %s\n", prog, dev, strerror(errno));
+        return -1;
+    }
+    t0 = now();
+    while (done < size) {
+        size_t len = size - done < bufsize ? size - done : bufsize;
+
+        n = write_it ? write(fd, buf, len) : read(fd, buf, len);
+        if (n <= 0) {
+            fprintf(stderr, "%s: %s: %s\n", prog, dev,
+                    n < 0 ? strerror(errno) : "short transfer");
+            close(fd);
+            return -1;
+        }
+        done += n;
+    }
+    t0 = now() - t0;
+    close(fd);
+    return done / t0;
+}
+
+int main(int argc, char **argv)
+{
+    static char *defaults[] = {"/dev/short0", "/dev/short0p", "/dev/short0s", NULL};
+    char **devs = defaults;
+    unsigned long size = 1 << 20;
+    size_t bufsize = 65536;
+    char *buf;
+    double r, w;
+    int i;
+
+    prog = argv[0];
+    if (argc > 1 && strspn(argv[1], "0123456789") == strlen(argv[1])) {
+        size = strtoul(argv[1], NULL, 0);
+        argc--; argv++;
+    }
+    if (argc > 1)
+        devs = argv + 1;
+    buf = calloc(1, bufsize);
+    if (!buf) {
+        fprintf(stderr, "%s: out of memory\n", prog);
+        exit(1);
+    }
+
+    for (i = 0; devs[i]; i++) {
+        r = run(devs[i], 0, buf, bufsize, size);
+        w = run(devs[i], 1, buf, bufsize, size);
+        printf("%-14s read %10.0f B/s   write %10.0f B/s\n", devs[i], r, w);
+    }
+    return 0;
+}
@@ -0,0 +1,139 @@
+/*
+ * shortmon.c -- consume short's binary interrupt records in place
+ *
+ * Maps the control page and the per-CPU rings of /dev/shortint (short
+ * loaded with binary=1), then drains the rings directly, moving the
+ * tails itself, and sleeps in poll() only when they are all empty.
+ * Every second it prints the event rate and what the kernel dropped.
+ * With -v, every record is printed too.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/mman.h>
+
+/* as in short/short.c */
+struct short_record {
+    uint64_t ns;
+    uint32_t irq;
+    uint32_t seq;
+};
+
+struct short_ring_head {
+    uint32_t head;
+    uint32_t tail;
+    uint32_t lost;
+    uint32_t pad[13];
+};
+
+struct short_ctl {
+    uint32_t version;
+    uint32_t nr_rings;
+    uint32_t ring_entries;
+    uint32_t rec_size;
+    uint32_t rings_offset;
+    uint32_t pad[11];
+    struct short_ring_head rings[];
+};
+
+static char *prog;
+
+static void die(const char *what)
+{
+    fprintf(stderr, "%s: %s: %s\n", prog, what, strerror(errno));
+    exit(1);
+}
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int main(int argc, char **argv)
+{
+    char *dev = "/dev/shortint";
+    struct short_ctl *ctl;
+    struct short_record *rings;
+    struct pollfd pfd;
+    unsigned long events = 0, lost, lost0 = 0;
+    int verbose = 0, fd, i;
+    double t0;
+
+    prog = argv[0];
+    if (argc > 1 && !strcmp(argv[1], "-v")) {
+        verbose = 1;
+        argc--; argv++;
+    }
+    if (argc > 1) dev = argv[1];
+
+    fd = open(dev, O_RDONLY);
+    if (fd < 0)
+        die(dev);
+    /* the control page first, to learn the layout */
+    ctl = mmap(NULL, getpagesize(), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (ctl == MAP_FAILED)
+        die("mmap control page");
+    if (ctl->version != 1 || ctl->rec_size != sizeof(struct short_record)) {
+        fprintf(stderr, "%s: unknown layout\n", prog);
+        exit(1);
+    }
+    if (ctl->rings_offset > getpagesize()) {
+        munmap(ctl, getpagesize());
+        ctl = mmap(NULL, ctl->rings_offset, PROT_READ | PROT_WRITE,
+                   MAP_SHARED, fd, 0);
+        if (ctl == MAP_FAILED)
+            die("mmap control page");
+    }
+    rings = mmap(NULL, (size_t)ctl->nr_rings * ctl->ring_entries * ctl->rec_size,
+                 PROT_READ, MAP_SHARED, fd, ctl->rings_offset);
+    if (rings == MAP_FAILED)
+        die("mmap rings");
+
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    t0 = now();
+    for (;;) {
+        int busy = 0;
+
+        for (i = 0; i < ctl->nr_rings; i++) {
+            struct short_ring_head *h = ctl->rings + i;
+            struct short_record *ring = rings + (size_t)i * ctl->ring_entries;
+            uint32_t tail = h->tail;
+            uint32_t head = __atomic_load_n(&h->head, __ATOMIC_ACQUIRE);
+
+            for (; tail != head; tail++, events++, busy = 1) {
+                struct short_record *r = ring + (tail & (ctl->ring_entries - 1));
+
+                if (verbose)
+                    printf("%u cpu%i irq %u %llu.%09llu\n", r->seq, i, r->irq,
+                           (unsigned long long)(r->ns / 1000000000),
+                           (unsigned long long)(r->ns % 1000000000));
+            }
+            __atomic_store_n(&h->tail, tail, __ATOMIC_RELEASE);
+        }
+
+        if (now() - t0 >= 1.0) {
+            for (lost = 0, i = 0; i < ctl->nr_rings; i++)
+                lost += ctl->rings[i].lost;
+            printf("%lu events/s, %lu dropped\n", events, lost - lost0);
+            fflush(stdout);
+            lost0 = lost;
+            events = 0;
+            t0 = now();
+        }
+        /* all empty: let the kernel wake us up */
+        if (!busy && poll(&pfd, 1, 1000) < 0 && errno != EINTR)
+            die("poll");
+    }
+    return 0;
+}
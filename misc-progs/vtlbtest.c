@@ -0,0 +1,130 @@
+/*
+ * vtlbtest.c -- random access timing over scullv quanta
+ *
+ * Fills a scullv device twice, once with 4k-mapped quanta and once
+ * with huge-mapped ones (scullv_huge=1), and reports the average time
+ * of a small pread() at random offsets for each. The syscall cost is
+ * the same in both runs, so the difference is what the TLB costs the
+ * driver's copy. Quanta must be PMD sized or more for the huge run to
+ * be any different: the order is set with the scullv ioctl.
+ *
+ * Needs root: it writes the module parameter and uses the "Tell" ioctl.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/ioctl.h>
+
+#define SCULLV_IOCTORDER _IO('k', 3) /* as in scullv/scull.h */
+#define HUGE_PARAM "/sys/module/scullv/parameters/scullv_huge"
+
+static char *prog;
+
+static void die(const char *what)
+{
+    fprintf(stderr, "%s: %s: %s\n", prog, what, strerror(errno));
+    exit(1);
+}
+
+static unsigned long xorshift(unsigned long *state)
+{
+    unsigned long x = *state;
+
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+static void set_huge(int on)
+{
+    FILE *f = fopen(HUGE_PARAM, "w");
+
+    if (!f)
+        die(HUGE_PARAM);
+    fprintf(f, "%i\n", on);
+    fclose(f);
+}
+
+/* write-only open trims the device, which takes the new order */
+static void fill(const char *dev, int order, unsigned long size)
+{
+    static char buf[65536];
+    unsigned long done = 0;
+    ssize_t n;
+    int fd;
+
+    fd = open(dev, O_RDWR);
+    if (fd < 0)
+        die(dev);
+    if (ioctl(fd, SCULLV_IOCTORDER, order) < 0)
+        die("ioctl");
+    close(fd);
+
+    fd = open(dev, O_WRONLY);
+    if (fd < 0)
+        die(dev);
+    memset(buf, 0x5a, sizeof(buf));
+    while (done < size) {
+        n = write(fd, buf, sizeof(buf));
+        if (n <= 0)
+            die("write");
+        done += n;
+    }
+    close(fd);
+}
+
+static double run(const char *dev, unsigned long size, unsigned long loops)
+{
+    struct timespec t0, t1;
+    unsigned long i, seed = 88172645463325252UL;
+    char word[8];
+    int fd;
+
+    fd = open(dev, O_RDONLY);
+    if (fd < 0)
+        die(dev);
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (i = 0; i < loops; i++) {
+        off_t off = xorshift(&seed) % (size - sizeof(word));
+
+        if (pread(fd, word, sizeof(word), off) != sizeof(word))
+            die("pread");
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    close(fd);
+    return ((t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec)) / loops;
+}
+
+int main(int argc, char **argv)
+{
+    char *dev = "/dev/scullv0";
+    unsigned long size = 64, loops = 1000000;
+    int order = 9, huge;
+
+    prog = argv[0];
+    if (argc > 1) dev = argv[1];
+    if (argc > 2) size = strtoul(argv[2], NULL, 0);
+    if (argc > 3) loops = strtoul(argv[3], NULL, 0);
+    if (argc > 4) order = atoi(argv[4]);
+    if (argc > 5) {
+        fprintf(stderr, "%s: Usage \"%s [device] [MB] [accesses] [order]\"\n",
+                prog, prog);
+        exit(1);
+    }
+    size <<= 20;
+
+    for (huge = 0; huge < 2; huge++) {
+        set_huge(huge);
+        fill(dev, order, size);
+        printf("%s quanta: %.1f ns/access (%lu MB, order %i)\n",
+               huge ? "huge" : "4k  ", run(dev, size, loops), size >> 20, order);
+    }
+    set_huge(0);
+    return 0;
+}
@@ -22,6 +22,8 @@
 #include <linux/semaphore.h> // struct semaphore
 #include <linux/proc_fs.h>  // read_procmem
 #include <linux/seq_file.h> // seq_file stack
+#include <linux/shrinker.h> // struct shrinker
+#include <linux/atomic.h>   // writers count
 
 #include "scull.h"
 
@@ -36,12 +38,16 @@ int scullc_minor = 0;
 int scullc_devs = SCULLC_DEVS;
 int scullc_quantum = SCULLC_QUANTUM;
 int scullc_qset  = SCULLC_QSET;
+int scullc_soft_limit = 0; /* bytes a cacheable device keeps under pressure */
+int scullc_adaptive = 1;   /* pick the quantum from the write sizes */
 
 module_param(scullc_major, int, S_IRUGO);
 module_param(scullc_minor, int, S_IRUGO);
 module_param(scullc_devs, int, S_IRUGO);
 module_param(scullc_quantum, int, S_IRUGO);
 module_param(scullc_qset, int, S_IRUGO);
+module_param(scullc_soft_limit, int, S_IRUGO | S_IWUSR);
+module_param(scullc_adaptive, int, S_IRUGO | S_IWUSR);
 
 MODULE_AUTHOR("Zynex Victor zyy");
 MODULE_LICENSE("GPL");
@@ -53,6 +59,77 @@ struct scullc_dev *scullc_devices = NULL;
 
 struct kmem_cache *scullc_cache;
 
+/*
+ * The size classes used in adaptive mode, smallest first: small
+ * records, the classic quantum and big streaming writes.
+ */
+static const int scullc_cache_size[SCULLC_NCACHES] = {
+    512, SCULLC_QUANTUM, 65536
+};
+static const char *scullc_cache_name[SCULLC_NCACHES] = {
+    "scullc-512", "scullc-4k", "scullc-64k"
+};
+static struct kmem_cache *scullc_caches[SCULLC_NCACHES];
+static int scullc_shrinker_on; /* registered, so unregister on cleanup */
+
+/* bytes handed back to the system by the shrinker so far */
+static atomic_long_t scullc_reclaimed = ATOMIC_LONG_INIT(0);
+
+static int scullc_hist_bucket(size_t count)
+{
+    if (!count)
+        return 0;
+    return min_t(int, ilog2(count), SCULLC_HIST_BUCKETS - 1);
+}
+
+/* The smallest cache holding "count" bytes, the biggest if none does */
+static int scullc_fit_cache(size_t count)
+{
+    int c;
+
+    for (c = 0; c < SCULLC_NCACHES - 1; c++)
+        if (count <= scullc_cache_size[c])
+            break;
+    return c;
+}
+
+/*
+ * Choose the cache for the next life of the device. The write sizes
+ * decide, weighted by the bytes they carry: the smallest class that
+ * holds in one piece the writes bringing half of the data or more
+ * wins, so record writers stop wasting most of each object and
+ * streamers stop paying per-quantum overhead. The history is halved
+ * so that the device follows a changing workload. Called from trim,
+ * when no quantum is allocated.
+ */
+static void scullc_pick_cache(struct scullc_dev *dev)
+{
+    u64 total = 0, seen = 0;
+    int b, c = 1; /* SCULLC_QUANTUM when we know nothing */
+
+    if (!scullc_adaptive) {
+        dev->cache = scullc_cache;
+        dev->quantum = scullc_quantum;
+        return;
+    }
+    for (b = 0; b < SCULLC_NCACHES; b++)
+        total += dev->wr_fit[b];
+    if (total) {
+        /* the cache the median byte was written for */
+        for (c = 0; c < SCULLC_NCACHES - 1; c++) {
+            seen += dev->wr_fit[c];
+            if (seen * 2 >= total)
+                break;
+        }
+    }
+    for (b = 0; b < SCULLC_HIST_BUCKETS; b++)
+        dev->wr_hist[b] >>= 1;
+    for (b = 0; b < SCULLC_NCACHES; b++)
+        dev->wr_fit[b] >>= 1;
+    dev->cache = scullc_caches[c];
+    dev->quantum = scullc_cache_size[c];
+}
+
 /*
  * Empty out the scull device; must be called with the device
  * semaphore held.
@@ -68,7 +145,7 @@ int scullc_trim(struct scullc_dev *dev)
             for (i = 0; i < qset; i++){
                 if (dptr->data[i]) {
                     //kfree(dptr->data[i]);
-                    kmem_cache_free(scullc_cache, dptr->data[i]);
+                    kmem_cache_free(dev->cache, dptr->data[i]);
                 }
             }
             kfree(dptr->data);
@@ -78,12 +155,128 @@ int scullc_trim(struct scullc_dev *dev)
         if (dptr != dev ) kfree(dptr); /* all of them but the first */
     }
     dev->size = 0;
-    dev->quantum = scullc_quantum;
+    dev->nquanta = 0;
+    scullc_pick_cache(dev);
     dev->qset = scullc_qset;
     dev->next = NULL;
     return 0;
 }
 
+/*
+ * Memory pressure: a device marked cacheable (SCULLC_IOCTCACHE) holds
+ * data that can be recomputed by its user, so when the VM asks us to
+ * shrink we drop every quantum lying past scullc_soft_limit bytes.
+ * Only clean devices are touched: nobody has them open for writing
+ * and the semaphore can be taken without sleeping.
+ */
+static size_t scullc_soft_bytes(void)
+{
+    return scullc_soft_limit > 0 ? scullc_soft_limit : 0;
+}
+
+static long scullc_soft_quanta(struct scullc_dev *dev)
+{
+    return DIV_ROUND_UP(scullc_soft_bytes(), dev->quantum);
+}
+
+/*
+ * Free all the quanta past the soft limit; must be called with the
+ * device semaphore held. Returns the number of quanta released.
+ */
+static long scullc_shrink_dev(struct scullc_dev *dev)
+{
+    struct scullc_dev *next, *prev = NULL, *dptr;
+    int qset = dev->qset;
+    long first = scullc_soft_quanta(dev); /* first quantum to go */
+    long q = 0, freed = 0;
+    int i;
+
+    for (dptr = dev; dptr; dptr = next, q += qset) {
+        next = dptr->next;
+        if (dptr->data) {
+            for (i = 0; i < qset; i++) {
+                if (q + i >= first && dptr->data[i]) {
+                    kmem_cache_free(dev->cache, dptr->data[i]);
+                    dptr->data[i] = NULL;
+                    freed++;
+                }
+            }
+        }
+        if (q < first || dptr == dev) { /* the first item always stays */
+            if (q >= first) {
+                kfree(dptr->data);
+                dptr->data = NULL;
+            }
+            prev = dptr;
+            continue;
+        }
+        /* the whole item is past the limit: unlink it */
+        prev->next = NULL;
+        kfree(dptr->data);
+        kfree(dptr);
+    }
+    if (dev->size > scullc_soft_bytes())
+        dev->size = scullc_soft_bytes();
+    dev->nquanta -= freed;
+    return freed;
+}
+
+static int scullc_reclaimable(struct scullc_dev *dev)
+{
+    return dev->cacheable && !atomic_read(&dev->writers);
+}
+
+static unsigned long scullc_shrink_count(struct shrinker *shrink,
+                        struct shrink_control *sc)
+{
+    unsigned long count = 0;
+    long extra;
+    int i;
+
+    /* racy on purpose: this is only an estimate for the VM */
+    for (i = 0; i < scullc_devs; i++) {
+        struct scullc_dev *dev = scullc_devices + i;
+
+        if (!scullc_reclaimable(dev))
+            continue;
+        extra = dev->nquanta - scullc_soft_quanta(dev);
+        if (extra > 0)
+            count += extra;
+    }
+    return count;
+}
+
+static unsigned long scullc_shrink_scan(struct shrinker *shrink,
+                        struct shrink_control *sc)
+{
+    unsigned long freed = 0;
+    long n;
+    int i;
+
+    for (i = 0; i < scullc_devs && freed < sc->nr_to_scan; i++) {
+        struct scullc_dev *dev = scullc_devices + i;
+
+        if (!scullc_reclaimable(dev))
+            continue;
+        if (down_trylock(&dev->sem)) /* busy: it's not clean anyway */
+            continue;
+        if (scullc_reclaimable(dev)) {
+            n = scullc_shrink_dev(dev);
+            atomic_long_add(n * dev->quantum, &scullc_reclaimed);
+            freed += n;
+        }
+        up(&dev->sem);
+    }
+    PDEBUG("shrinker released %lu quanta\n", freed);
+    return freed ? freed : SHRINK_STOP;
+}
+
+static struct shrinker scullc_shrinker = {
+    .count_objects = scullc_shrink_count,
+    .scan_objects  = scullc_shrink_scan,
+    .seeks         = DEFAULT_SEEKS,
+};
+
 #ifdef SCULLC_DEBUG /* Use proc filesystem if debugging */
 
 /**
@@ -129,6 +322,15 @@ static int scullc_seq_show(struct seq_file *s, void *v)
     /*scan the list*/
     seq_printf(s, "\nDevice %i: qset %i, quantum %i, sz %li\n", (int)(dev - scullc_devices),
                 qset, quantum, (long)dev->size);
+    seq_printf(s, "  cacheable %i, quanta %i, reclaimed %li (all devices)\n",
+                dev->cacheable, dev->nquanta, atomic_long_read(&scullc_reclaimed));
+    seq_printf(s, "  adaptive %i, frag %li of %li bytes\n", scullc_adaptive,
+                (long)dev->nquanta * quantum - (long)dev->size,
+                (long)dev->nquanta * quantum);
+    seq_printf(s, "  write sizes (log2):");
+    for (i = 0; i < SCULLC_HIST_BUCKETS; i++)
+        seq_printf(s, " %lu", dev->wr_hist[i]);
+    seq_printf(s, "\n");
     for (; d; d = d->next) { /* scan the list */ 
         seq_printf(s, "  item at %p, qset at %p\n", d, d->data);
         if (d->data && !d->next) /* Dump only the last item*/
@@ -223,6 +425,9 @@ int scullc_open(struct inode *inode, struct file *filp)
         scullc_trim(dev);    /* ignore errors */
         up(&dev->sem);
     }
+    /* a device with writers is dirty: keep the shrinker away */
+    if (filp->f_mode & FMODE_WRITE)
+        atomic_inc(&dev->writers);
     /* and use filp->private_data to point to the device data */
     filp->private_data = dev; /* for other methods */ 
     return 0;       /* success */
@@ -230,6 +435,10 @@ int scullc_open(struct inode *inode, struct file *filp)
 
 int scullc_release(struct inode *inode, struct file *filp)
 {
+    struct scullc_dev *dev = filp->private_data;
+
+    if (filp->f_mode & FMODE_WRITE)
+        atomic_dec(&dev->writers);
     return 0;
 }
 
@@ -315,6 +524,8 @@ ssize_t scullc_write(struct file *filp, const char __user *buf, size_t count,
 
     if (down_interruptible(&dev->sem)) 
         return -ERESTARTSYS;
+    dev->wr_hist[scullc_hist_bucket(count)]++;
+    dev->wr_fit[scullc_fit_cache(count)] += count;
     
     /* find listitem, qset index and offset in the quantum */
     item = (long)*f_pos / itemsize;
@@ -333,10 +544,11 @@ ssize_t scullc_write(struct file *filp, const char __user *buf, size_t count,
     }
 
     if (!dptr->data[s_pos]) {
-        dptr->data[s_pos] = kmem_cache_alloc(scullc_cache, GFP_KERNEL);
+        dptr->data[s_pos] = kmem_cache_alloc(dev->cache, GFP_KERNEL);
         if (!dptr->data[s_pos])
             goto out;
-        memset(dptr->data[s_pos], 0, scullc_quantum);
+        memset(dptr->data[s_pos], 0, quantum);
+        dev->nquanta++;
     }
     /* write only up to the end of this quantum */
     if (count > quantum - q_pos)
@@ -364,6 +576,7 @@ out:
 long scullc_ioctl(struct file *filp,
                         unsigned int cmd, unsigned long arg)
 {
+    struct scullc_dev *dev = filp->private_data;
     int err = 0, tmp;
     int retval = 0;
 
@@ -462,6 +675,16 @@ long scullc_ioctl(struct file *filp,
         scullc_qset = arg;
         return tmp;
 
+    case SCULLC_IOCTCACHE: /* Tell: mark this device reclaimable or not */
+        if (down_interruptible(&dev->sem))
+            return -ERESTARTSYS;
+        dev->cacheable = !!arg;
+        up(&dev->sem);
+        break;
+
+    case SCULLC_IOCQCACHE: /* Query: is this device a cache? */
+        return dev->cacheable;
+
         /*
          * The following two change the buffer size for scullpipe.
          * The scullpipe device uses this same ioctl method, just to
@@ -567,6 +790,10 @@ static void scullc_cleanup_module(void)
     int i;
     dev_t devno = MKDEV(scullc_major, scullc_minor);
 
+    /* Nothing may walk the devices after this point */
+    if (scullc_shrinker_on)
+        unregister_shrinker(&scullc_shrinker);
+
     /* Get rid of our char dev entries */
     if (scullc_devices) {
         for (i = 0; i < scullc_devs; i++) {
@@ -581,6 +808,8 @@ static void scullc_cleanup_module(void)
 #endif
     if (scullc_cache)
         kmem_cache_destroy(scullc_cache);
+    for (i = 0; i < SCULLC_NCACHES; i++)
+        kmem_cache_destroy(scullc_caches[i]); /* NULL is fine */
 	/* cleanup_module is never called if registering failed */
     unregister_chrdev_region(devno, scullc_devs);
 }
@@ -628,16 +857,9 @@ static int __init scullc_init_module(void)
      */
     memset(scullc_devices, 0, sizeof(struct scullc_dev) * scullc_devs);
 
-    /* Initialize each device */
-    for (i = 0; i < scullc_devs; i++) {
-        scullc_devices[i].quantum = scullc_quantum;
-        scullc_devices[i].qset = scullc_qset;
-        sema_init(&scullc_devices[i].sem, 1);   // semaphore value is one
-        scullc_setup_cdev(&scullc_devices[i], i);
-    }
-
     /**
      * allocate kmem cache---- only ctor function no dtor function
+     * The caches must exist before the devices go live.
      */
     scullc_cache = kmem_cache_create("scullc", scullc_quantum, 0,
             SLAB_HWCACHE_ALIGN, NULL);
@@ -645,6 +867,31 @@ static int __init scullc_init_module(void)
         scullc_cleanup_module();
         return -ENOMEM;
     }
+    for (i = 0; i < SCULLC_NCACHES; i++) {
+        scullc_caches[i] = kmem_cache_create(scullc_cache_name[i],
+                scullc_cache_size[i], 0, SLAB_HWCACHE_ALIGN, NULL);
+        if (!scullc_caches[i]) {
+            scullc_cleanup_module();
+            return -ENOMEM;
+        }
+    }
+
+    /* Initialize each device */
+    for (i = 0; i < scullc_devs; i++) {
+        scullc_pick_cache(scullc_devices + i);
+        scullc_devices[i].qset = scullc_qset;
+        sema_init(&scullc_devices[i].sem, 1);   // semaphore value is one
+        atomic_set(&scullc_devices[i].writers, 0);
+        scullc_setup_cdev(&scullc_devices[i], i);
+    }
+
+    /* Let the VM reclaim cacheable devices when memory is short */
+    result = register_shrinker(&scullc_shrinker);
+    if (result) {
+        scullc_cleanup_module();
+        return result;
+    }
+    scullc_shrinker_on = 1;
 
 #ifdef SCULLC_DEBUG
     scullc_create_proc(); /* Only when debugging */
@@ -58,14 +58,32 @@
 
 #define SCULLC_QSET    500
 
+/*
+ * Adaptive quantum: each device logs the size of every write() in
+ * log2 buckets (bucket b counts sizes in [2^b, 2^(b+1))), for
+ * /proc/scullcseq, and its bytes by the smallest cache holding it in
+ * one piece. On trim it picks the slab cache that best fits what it
+ * has been seeing, from the latter: the log2 buckets straddle the
+ * cache sizes. Counting bytes rather than calls keeps the short
+ * retries of a write cut at a quantum end from outvoting it.
+ */
+#define SCULLC_HIST_BUCKETS 17      /* up to 64k and beyond */
+#define SCULLC_NCACHES      3       /* 512, SCULLC_QUANTUM and 64k */
+
 
 struct scullc_dev {
 	void **data;
 	struct scullc_dev *next;  /* next listitem */
 	int vmas;			      /* active mappings */
 	int quantum;              /* the current quantum size */
+	struct kmem_cache *cache; /* where the quanta come from */
 	int qset;                 /* the current array size */
 	size_t size;       		  /* 32-bit will suffice */
+	int cacheable;            /* may be reclaimed under pressure */
+	int nquanta;              /* quanta allocated over the list */
+	atomic_t writers;         /* opens with FMODE_WRITE */
+	unsigned long wr_hist[SCULLC_HIST_BUCKETS]; /* write() sizes */
+	u64 wr_fit[SCULLC_NCACHES]; /* ... bytes, by the cache they fit */
 	struct semaphore sem;     /* mutual exclusion semaphore     */
 	struct cdev cdev;	      /* Char device structure		*/
 };
@@ -87,6 +105,8 @@ extern int scullc_major;     /* main.c */
 extern int scullc_devs;
 extern int scullc_order;
 extern int scullc_qset;
+extern int scullc_soft_limit;
+extern int scullc_adaptive;
 
 
 /*
@@ -129,6 +149,14 @@ struct scullc_dev *scullc_follow(struct scullc_dev *dev, int n);
 #define SCULLC_IOCHQSET    _IO(SCULLC_IOC_MAGIC,  12)
 
 
-#define SCULLC_IOC_MAXNR 12
+/*
+ * Per-device knobs: these act on the open device, not on the globals.
+ * CACHE marks the device as a cache tier the shrinker may trim back
+ * to scullc_soft_limit bytes when the system runs short of memory.
+ */
+#define SCULLC_IOCTCACHE    _IO(SCULLC_IOC_MAGIC,  13)
+#define SCULLC_IOCQCACHE    _IO(SCULLC_IOC_MAGIC,  14)
+
+#define SCULLC_IOC_MAXNR 14
 
 #endif /* _SCULL_H_ */
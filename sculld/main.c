@@ -26,6 +26,18 @@
 #include <linux/proc_fs.h>
 #include <linux/fcntl.h>	/* O_ACCMODE */
 #include <linux/aio.h>
+#include <linux/uio.h>		/* iov_iter */
+#include <linux/workqueue.h>
+#include <linux/mempool.h>
+#include <linux/sched/mm.h>	/* mmget(), mmput() */
+#include <linux/mmu_context.h>	/* use_mm() */
+#include <linux/ktime.h>	/* op latencies */
+#include <linux/sysfs.h>
+#include <linux/idr.h>		/* minor -> device */
+#include <linux/mutex.h>
+#include <linux/pm_runtime.h>
+#include <linux/lz4.h>		/* idle devices are compressed */
+#include <linux/vmalloc.h>
 #include <asm/uaccess.h>
 #include <linux/uaccess.h>
 
@@ -33,17 +45,27 @@
 
 int sculld_major =   SCULLD_MAJOR;
 int sculld_devs =    SCULLD_DEVS;	/* number of bare sculld devices */
+int sculld_max_devs = 4096;		/* minors kept for runtime creation */
 int sculld_qset =    SCULLD_QSET;
 int sculld_order =   SCULLD_ORDER;
+int sculld_autosuspend_ms = -1;		/* idle time before compressing */
 
 module_param(sculld_major, int, 0);
 module_param(sculld_devs, int, 0);
+module_param(sculld_max_devs, int, 0);
 module_param(sculld_qset, int, 0);
 module_param(sculld_order, int, 0);
+module_param(sculld_autosuspend_ms, int, S_IRUGO);
 MODULE_AUTHOR("Alessandro Rubini");
 MODULE_LICENSE("Dual BSD/GPL");
 
-struct sculld_dev *sculld_devices; /* allocated in sculld_init */
+/*
+ * The devices are allocated one by one, at load time or later through
+ * /sys/bus/ldd/new_device, and found by minor number in this table.
+ * A device lives as long as it is registered or open.
+ */
+static DEFINE_IDR(sculld_idr);
+static DEFINE_MUTEX(sculld_idr_lock);	/* protects sculld_idr */
 
 int sculld_trim(struct sculld_dev *dev);
 void sculld_cleanup(void);
@@ -52,20 +74,66 @@ void sculld_cleanup(void);
 
 /* Device model stuff */
 
+static int sculld_new_device(struct ldd_driver *driver, const char *args);
+static int sculld_delete_device(struct ldd_driver *driver, const char *name);
+
+static int sculld_runtime_suspend(struct ldd_device *ldev);
+static int sculld_runtime_resume(struct ldd_device *ldev);
+
 static struct ldd_driver sculld_driver = {
 	.version = "$Revision: 1.21 $",
 	.module = THIS_MODULE,
 	.driver = {
 		.name = "sculld",
 	},
+	.new_device = sculld_new_device,
+	.delete_device = sculld_delete_device,
+	.runtime_suspend = sculld_runtime_suspend,
+	.runtime_resume = sculld_runtime_resume,
 };
 
 
 
+
 #ifdef SCULLD_USE_PROC /* don't waste space if unused */
 
 #endif /* SCULLD_USE_PROC */
 
+/*
+ * Statistics: every read and write is accounted when it's over.
+ */
+static void sculld_account(struct sculld_dev *dev, int write, ssize_t bytes,
+		u64 start)
+{
+	struct sculld_stats *st = &dev->stats;
+	u64 ns = ktime_get_ns() - start;
+
+	spin_lock(&dev->stats_lock);
+	if (write) {
+		if (bytes > 0)
+			st->write_bytes += bytes;
+		st->write_ops++;
+		st->write_ns += ns;
+		if (ns > st->write_max_ns)
+			st->write_max_ns = ns;
+	} else {
+		if (bytes > 0)
+			st->read_bytes += bytes;
+		st->read_ops++;
+		st->read_ns += ns;
+		if (ns > st->read_max_ns)
+			st->read_max_ns = ns;
+	}
+	spin_unlock(&dev->stats_lock);
+}
+
+static void sculld_count_quantum(struct sculld_dev *dev)
+{
+	spin_lock(&dev->stats_lock);
+	dev->stats.quanta++;
+	spin_unlock(&dev->stats_lock);
+}
+
 /*
  * Open and close
  */
@@ -73,14 +141,32 @@ static struct ldd_driver sculld_driver = {
 int sculld_open (struct inode *inode, struct file *filp)
 {
 	struct sculld_dev *dev; /* device information */
+	int result;
 
-	/*  Find the device */
-	dev = container_of(inode->i_cdev, struct sculld_dev, cdev);
+	/*  Find the device, it may be going away right now */
+	mutex_lock(&sculld_idr_lock);
+	dev = idr_find(&sculld_idr, iminor(inode));
+	if (dev)
+		get_device(&dev->ldev.dev);
+	mutex_unlock(&sculld_idr_lock);
+	if (!dev)
+		return -ENODEV;
+
+	/* an open device is awake: this brings the data back if needed */
+	result = pm_runtime_get_sync(&dev->ldev.dev);
+	if (result < 0) {
+		pm_runtime_put_noidle(&dev->ldev.dev);
+		put_device(&dev->ldev.dev);
+		return result;
+	}
 
     	/* now trim to 0 the length of the device if open was write-only */
 	if ( (filp->f_flags & O_ACCMODE) == O_WRONLY) {
-		if (down_interruptible (&dev->sem))
+		if (down_interruptible (&dev->sem)) {
+			pm_runtime_put_autosuspend(&dev->ldev.dev);
+			put_device(&dev->ldev.dev);
 			return -ERESTARTSYS;
+		}
 		sculld_trim(dev); /* ignore errors */
 		up (&dev->sem);
 	}
@@ -93,6 +179,12 @@ int sculld_open (struct inode *inode, struct file *filp)
 
 int sculld_release (struct inode *inode, struct file *filp)
 {
+	struct sculld_dev *dev = filp->private_data;
+
+	/* the last close starts the autosuspend timer */
+	pm_runtime_mark_last_busy(&dev->ldev.dev);
+	pm_runtime_put_autosuspend(&dev->ldev.dev);
+	put_device(&dev->ldev.dev);
 	return 0;
 }
 
@@ -105,6 +197,7 @@ struct sculld_dev *sculld_follow(struct sculld_dev *dev, int n)
 		if (!dev->next) {
 			dev->next = kmalloc(sizeof(struct sculld_dev), GFP_KERNEL);
 			memset(dev->next, 0, sizeof(struct sculld_dev));
+			dev->next->order = dev->order; /* same quantum all along */
 		}
 		dev = dev->next;
 		continue;
@@ -116,7 +209,7 @@ struct sculld_dev *sculld_follow(struct sculld_dev *dev, int n)
  * Data management: read and write
  */
 
-ssize_t sculld_read (struct file *filp, char __user *buf, size_t count,
+static ssize_t sculld_do_read (struct file *filp, char __user *buf, size_t count,
                 loff_t *f_pos)
 {
 	struct sculld_dev *dev = filp->private_data; /* the first listitem */
@@ -143,6 +236,9 @@ ssize_t sculld_read (struct file *filp, char __user *buf, size_t count,
 
 	if (!dptr->data)
 		goto nothing; /* don't fill holes */
+	retval = sculld_unzip(dev, dptr, s_pos);
+	if (retval)
+		goto nothing;
 	if (!dptr->data[s_pos])
 		goto nothing;
 	if (count > quantum - q_pos)
@@ -164,7 +260,7 @@ ssize_t sculld_read (struct file *filp, char __user *buf, size_t count,
 
 
 
-ssize_t sculld_write (struct file *filp, const char __user *buf, size_t count,
+static ssize_t sculld_do_write (struct file *filp, const char __user *buf, size_t count,
                 loff_t *f_pos)
 {
 	struct sculld_dev *dev = filp->private_data;
@@ -172,7 +268,7 @@ ssize_t sculld_write (struct file *filp, const char __user *buf, size_t count,
 	int quantum = PAGE_SIZE << dev->order;
 	int qset = dev->qset;
 	int itemsize = quantum * qset;
-	int item, s_pos, q_pos, rest;
+	int item, s_pos, q_pos, rest, err;
 	ssize_t retval = -ENOMEM; /* our most likely error */
 
 	if (down_interruptible (&dev->sem))
@@ -191,6 +287,11 @@ ssize_t sculld_write (struct file *filp, const char __user *buf, size_t count,
 			goto nomem;
 		memset(dptr->data, 0, qset * sizeof(char *));
 	}
+	err = sculld_unzip(dev, dptr, s_pos);
+	if (err) {
+		retval = err;
+		goto nomem;
+	}
 	/* Here's the allocation of a single quantum */
 	if (!dptr->data[s_pos]) {
 		dptr->data[s_pos] =
@@ -198,6 +299,7 @@ ssize_t sculld_write (struct file *filp, const char __user *buf, size_t count,
 		if (!dptr->data[s_pos])
 			goto nomem;
 		memset(dptr->data[s_pos], 0, PAGE_SIZE << dptr->order);
+		sculld_count_quantum(dev);
 	}
 	if (count > quantum - q_pos)
 		count = quantum - q_pos; /* write only up to the end of this quantum */
@@ -218,6 +320,26 @@ ssize_t sculld_write (struct file *filp, const char __user *buf, size_t count,
 	return retval;
 }
 
+ssize_t sculld_read (struct file *filp, char __user *buf, size_t count,
+                loff_t *f_pos)
+{
+	u64 start = ktime_get_ns();
+	ssize_t retval = sculld_do_read(filp, buf, count, f_pos);
+
+	sculld_account(filp->private_data, 0, retval, start);
+	return retval;
+}
+
+ssize_t sculld_write (struct file *filp, const char __user *buf, size_t count,
+                loff_t *f_pos)
+{
+	u64 start = ktime_get_ns();
+	ssize_t retval = sculld_do_write(filp, buf, count, f_pos);
+
+	sculld_account(filp->private_data, 1, retval, start);
+	return retval;
+}
+
 /*
  * The ioctl() implementation
  */
@@ -344,38 +466,191 @@ loff_t sculld_llseek (struct file *filp, loff_t off, int whence)
 }
 
 
+/*
+ * Data transfer through an iov_iter, for read_iter and write_iter.
+ * Unlike read and write it doesn't stop at the end of a quantum, so
+ * that an asynchronous request is served in one go. Reads stop at the
+ * first hole.
+ */
+static ssize_t sculld_transfer(struct sculld_dev *dev, int write,
+		struct iov_iter *iter, loff_t *pos)
+{
+	struct sculld_dev *dptr;
+	int quantum = PAGE_SIZE << dev->order;
+	int qset = dev->qset;
+	int itemsize = quantum * qset;
+	int item, s_pos, q_pos, rest;
+	size_t count, done = 0;
+	ssize_t retval = 0;
+
+	if (down_interruptible (&dev->sem))
+		return -ERESTARTSYS;
+	while (iov_iter_count(iter)) {
+		count = iov_iter_count(iter);
+		if (!write) {
+			if (*pos >= dev->size)
+				break;
+			if (*pos + count > dev->size)
+				count = dev->size - *pos;
+		}
+		item = ((long) *pos) / itemsize;
+		rest = ((long) *pos) % itemsize;
+		s_pos = rest / quantum; q_pos = rest % quantum;
+
+		dptr = sculld_follow(dev, item);
+		if (!dptr->data && write) {
+			dptr->data = kzalloc(qset * sizeof(void *), GFP_KERNEL);
+			if (!dptr->data) {
+				retval = -ENOMEM;
+				break;
+			}
+		}
+		if (dptr->data) {
+			retval = sculld_unzip(dev, dptr, s_pos);
+			if (retval)
+				break;
+		}
+		if (dptr->data && !dptr->data[s_pos] && write) {
+			dptr->data[s_pos] = (void *)__get_free_pages(GFP_KERNEL | __GFP_ZERO,
+					dptr->order);
+			if (!dptr->data[s_pos]) {
+				retval = -ENOMEM;
+				break;
+			}
+			sculld_count_quantum(dev);
+		}
+		if (!dptr->data || !dptr->data[s_pos])
+			break; /* don't fill holes */
+		if (count > quantum - q_pos)
+			count = quantum - q_pos;
+
+		if (write)
+			count = copy_from_iter(dptr->data[s_pos] + q_pos, count, iter);
+		else
+			count = copy_to_iter(dptr->data[s_pos] + q_pos, count, iter);
+		*pos += count;
+		done += count;
+		if (write && dev->size < *pos)
+			dev->size = *pos;
+		if (!count) {
+			retval = -EFAULT;
+			break;
+		}
+	}
+	up (&dev->sem);
+	return done ? done : retval;
+}
+
 /*
  * A simple asynchronous I/O implementation.
+ *
+ * Every device has a queue of pending iocbs, served in order by a
+ * single work item: the transfer and the completion both happen in
+ * the worker, on the submitter's mm. A run serves at most
+ * SCULLD_AIO_BATCH requests and requeues itself if more are waiting,
+ * so that a flood on one device can't delay the completions of the
+ * others for long.
  */
+#define SCULLD_AIO_POOL		64	/* async_work kept in reserve */
+#define SCULLD_AIO_BATCH	32	/* requests per worker run */
 
 struct async_work {
 	struct kiocb *iocb;
-	int result;
-	struct work_struct work;
+	int write;
+	struct iov_iter iter;		/* our copy of the caller's iterator */
+	const void *iov;		/* segment array behind iter */
+	struct mm_struct *mm;		/* whose buffers iter points to */
+	u64 start;			/* submission time, for the stats */
+	struct list_head list;
 };
 
+static struct workqueue_struct *sculld_aio_wq;
+static mempool_t *sculld_aio_pool;
+
 /*
- * "Complete" an asynchronous operation.
+ * "Complete" the queued asynchronous operations of a device.
  */
-static void sculld_do_deferred_op(void *p)
+static void sculld_do_deferred_op(struct work_struct *p)
 {
+	struct sculld_dev *dev = container_of(p, struct sculld_dev, aio_work);
+	struct async_work *stuff;
+	ssize_t result;
+	int n;
+
+	for (n = 0; n < SCULLD_AIO_BATCH; n++) {
+		spin_lock(&dev->aio_lock);
+		stuff = list_first_entry_or_null(&dev->aio_queue,
+				struct async_work, list);
+		if (stuff)
+			list_del(&stuff->list);
+		spin_unlock(&dev->aio_lock);
+		if (!stuff)
+			return;
+
+		use_mm(stuff->mm);
+		result = sculld_transfer(dev, stuff->write, &stuff->iter,
+				&stuff->iocb->ki_pos);
+		unuse_mm(stuff->mm);
+		mmput(stuff->mm);
+		kfree(stuff->iov);
+		sculld_account(dev, stuff->write, result, stuff->start);
+		stuff->iocb->ki_complete(stuff->iocb, result, 0);
+		mempool_free(stuff, sculld_aio_pool);
+	}
+
+	/* budget exhausted: let the others run, then come back */
+	spin_lock(&dev->aio_lock);
+	if (!list_empty(&dev->aio_queue))
+		queue_work(sculld_aio_wq, &dev->aio_work);
+	spin_unlock(&dev->aio_lock);
 }
 
 
-static int sculld_defer_op(int write, struct kiocb *iocb, char __user *buf,
-		size_t count, loff_t pos)
+static ssize_t sculld_defer_op(int write, struct kiocb *iocb, struct iov_iter *iov)
 {
-
+	struct sculld_dev *dev = iocb->ki_filp->private_data;
+	struct async_work *stuff;
+	u64 start = ktime_get_ns();
+	ssize_t result;
+
+	/* If this is a synchronous IOCB, do it now. */
+	if (is_sync_kiocb(iocb) || !current->mm)
+		goto sync;
+
+	/* The caller's segment array is gone when we return: copy it */
+	stuff = mempool_alloc(sculld_aio_pool, GFP_KERNEL);
+	stuff->iov = dup_iter(&stuff->iter, iov, GFP_KERNEL);
+	if (!stuff->iov && iov_iter_count(iov)) {
+		mempool_free(stuff, sculld_aio_pool);
+		goto sync;
+	}
+	stuff->start = start;
+	stuff->iocb = iocb;
+	stuff->write = write;
+	stuff->mm = current->mm;
+	mmget(stuff->mm);
+
+	spin_lock(&dev->aio_lock);
+	list_add_tail(&stuff->list, &dev->aio_queue);
+	queue_work(sculld_aio_wq, &dev->aio_work); /* no-op if pending */
+	spin_unlock(&dev->aio_lock);
+	return -EIOCBQUEUED;
+
+sync:
+	result = sculld_transfer(dev, write, iov, &iocb->ki_pos);
+	sculld_account(dev, write, result, start);
+	return result;
 }
 
 
 static ssize_t sculld_aio_read(struct kiocb *iocb, struct iov_iter *iov)
 {
-
+	return sculld_defer_op(0, iocb, iov);
 }
+
 static ssize_t sculld_aio_write(struct kiocb *iocb, struct iov_iter *iov)
 {
-
+	return sculld_defer_op(1, iocb, iov);
 }
 
 
@@ -423,47 +698,430 @@ int sculld_trim(struct sculld_dev *dev)
 			kfree(dptr->data);
 			dptr->data=NULL;
 		}
+		if (dptr->zdata) {
+			for (i = 0; i < qset; i++)
+				kfree(dptr->zdata[i]);
+			kfree(dptr->zdata);
+			dptr->zdata = NULL;
+		}
 		next=dptr->next;
 		if (dptr != dev) kfree(dptr); /* all of them but the first */
 	}
 	dev->size = 0;
+	dev->zbytes = 0;
+	spin_lock(&dev->stats_lock);
+	dev->stats.quanta = 0;
+	spin_unlock(&dev->stats_lock);
 	dev->qset = sculld_qset;
 	dev->order = sculld_order;
 	dev->next = NULL;
 	return 0;
 }
 
+/*
+ * Runtime power management. A device nobody has open for
+ * sculld_autosuspend_ms (or power/autosuspend_delay_ms in sysfs) is
+ * suspended by the bus: its quanta are compressed with LZ4 and the
+ * pages go back to the system. The next open resumes it and
+ * decompresses them. A quantum that doesn't shrink by 1/8 at least is
+ * left as it is. A negative delay, the default, never suspends.
+ *
+ * Resume can't fail: the PM core would remember the error and refuse
+ * every later open. A quantum that can't be expanded then (no memory)
+ * stays compressed, and read, write and mmap expand it when they get
+ * to it, through sculld_unzip.
+ */
+
+/*
+ * Expand quantum i of list item dptr if it is compressed; called with
+ * the semaphore held. Returns 0 when the quantum is (or stays) plain.
+ */
+int sculld_unzip(struct sculld_dev *dev, struct sculld_dev *dptr, int i)
+{
+	struct sculld_zquantum *zq;
+	int quantum = PAGE_SIZE << dev->order;
+	void *page;
+
+	if (!dptr->zdata || !dptr->zdata[i])
+		return 0;
+	zq = dptr->zdata[i];
+	page = (void *)__get_free_pages(GFP_KERNEL, dptr->order);
+	if (!page)
+		return -ENOMEM;
+	if (LZ4_decompress_safe(zq->buf, page, zq->len, quantum) != quantum) {
+		free_pages((unsigned long)page, dptr->order);
+		return -EIO;
+	}
+	dptr->data[i] = page;
+	dptr->zdata[i] = NULL;
+	dev->zbytes -= zq->len;
+	kfree(zq);
+	return 0;
+}
+
+static int sculld_expand(struct sculld_dev *dev)
+{
+	struct sculld_dev *dptr;
+	int qset = dev->qset;
+	int i, err;
+
+	for (dptr = dev; dptr; dptr = dptr->next) {
+		if (!dptr->zdata)
+			continue;
+		for (i = 0; i < qset; i++) {
+			err = sculld_unzip(dev, dptr, i);
+			if (err)
+				return err; /* the rest stays compressed */
+		}
+		kfree(dptr->zdata);
+		dptr->zdata = NULL;
+	}
+	return 0;
+}
+
+static int sculld_compress(struct sculld_dev *dev)
+{
+	struct sculld_dev *dptr;
+	struct sculld_zquantum *zq;
+	int quantum = PAGE_SIZE << dev->order;
+	int bound = LZ4_compressBound(quantum);
+	int qset = dev->qset;
+	void *wrkmem, *tmp;
+	int i, len, ret = 0;
+
+	wrkmem = vmalloc(LZ4_MEM_COMPRESS);
+	tmp = vmalloc(bound);
+	if (!wrkmem || !tmp) {
+		ret = -EAGAIN;
+		goto out;
+	}
+	for (dptr = dev; dptr; dptr = dptr->next) {
+		if (!dptr->data)
+			continue;
+		if (!dptr->zdata) {
+			dptr->zdata = kcalloc(qset, sizeof(*dptr->zdata),
+					GFP_KERNEL);
+			if (!dptr->zdata)
+				goto nomem;
+		}
+		for (i = 0; i < qset; i++) {
+			if (!dptr->data[i])
+				continue;
+			len = LZ4_compress_default(dptr->data[i], tmp, quantum,
+					bound, wrkmem);
+			if (len <= 0 || len > quantum - quantum / 8)
+				continue; /* not worth it */
+			zq = kmalloc(sizeof(*zq) + len, GFP_KERNEL);
+			if (!zq)
+				goto nomem;
+			zq->len = len;
+			memcpy(zq->buf, tmp, len);
+			dptr->zdata[i] = zq;
+			free_pages((unsigned long)dptr->data[i], dptr->order);
+			dptr->data[i] = NULL;
+			dev->zbytes += len;
+		}
+	}
+	goto out;
+
+  nomem: /* stay awake, with everything where it was */
+	sculld_expand(dev);
+	ret = -EAGAIN;
+  out:
+	vfree(tmp);
+	vfree(wrkmem);
+	return ret;
+}
+
+static int sculld_runtime_suspend(struct ldd_device *ldev)
+{
+	struct sculld_dev *dev = container_of(ldev, struct sculld_dev, ldev);
+	int ret;
+
+	if (down_trylock(&dev->sem))
+		return -EBUSY; /* try again later */
+	ret = dev->vmas ? -EBUSY : sculld_compress(dev);
+	up(&dev->sem);
+	PDEBUG("%s suspended: %zi bytes compressed\n", dev->devname,
+			dev->zbytes);
+	return ret;
+}
+
+static int sculld_runtime_resume(struct ldd_device *ldev)
+{
+	struct sculld_dev *dev = container_of(ldev, struct sculld_dev, ldev);
+	int ret;
+
+	down(&dev->sem);
+	ret = sculld_expand(dev);
+	up(&dev->sem);
+	if (ret)
+		PDEBUG("%s resumed with %zi bytes still compressed (%d)\n",
+				dev->devname, dev->zbytes, ret);
+	return 0; /* whatever is left is expanded on access */
+}
+
 
-static void sculld_setup_cdev(struct sculld_dev *dev, int index)
+/*
+ * The cdev is allocated apart, as an open file may hold it after the
+ * device is deleted; open looks the device up in sculld_idr instead.
+ */
+static int sculld_setup_cdev(struct sculld_dev *dev, int index)
 {
 	int err, devno = MKDEV(sculld_major, index);
     
-	cdev_init(&dev->cdev, &sculld_fops);
-	dev->cdev.owner = THIS_MODULE;
-	dev->cdev.ops = &sculld_fops;
-	err = cdev_add (&dev->cdev, devno, 1);
+	dev->cdev = cdev_alloc();
+	if (!dev->cdev)
+		return -ENOMEM;
+	dev->cdev->owner = THIS_MODULE;
+	dev->cdev->ops = &sculld_fops;
+	err = cdev_add (dev->cdev, devno, 1);
 	/* Fail gracefully if need be */
-	if (err)
+	if (err) {
 		printk(KERN_NOTICE "Error %d adding scull%d", err, index);
+		kobject_put(&dev->cdev->kobj);
+		dev->cdev = NULL;
+	}
+	return err;
 }
 
 static ssize_t sculld_show_dev(struct device *ddev, struct device_attribute *attr, char *buf)
 {
 	struct sculld_dev *dev = ddev->driver_data;
 
-	return print_dev_t(buf, dev->cdev.dev);
+	return print_dev_t(buf, dev->cdev->dev);
 }
 
 static DEVICE_ATTR(dev, S_IRUGO, sculld_show_dev, NULL);
 
-static void sculld_register_dev(struct sculld_dev *dev, int index)
+/*
+ * Live statistics in sysfs: one value per file for people, and the
+ * whole struct sculld_stats in "stats" for monitors.
+ */
+static void sculld_snapshot(struct sculld_dev *dev, struct sculld_stats *st)
+{
+	spin_lock(&dev->stats_lock);
+	*st = dev->stats;
+	spin_unlock(&dev->stats_lock);
+	st->version = SCULLD_STATS_VERSION;
+	st->order = dev->order; /* racy, but these are just numbers */
+	st->qset = dev->qset;
+	st->size = dev->size;
+}
+
+#define SCULLD_STAT_ATTR(_name, _expr)					\
+static ssize_t sculld_show_##_name(struct device *ddev,			\
+		struct device_attribute *attr, char *buf)		\
+{									\
+	struct sculld_stats st;						\
+									\
+	sculld_snapshot(ddev->driver_data, &st);			\
+	return sprintf(buf, "%llu\n", (unsigned long long)(_expr));	\
+}									\
+static DEVICE_ATTR(_name, S_IRUGO, sculld_show_##_name, NULL)
+
+SCULLD_STAT_ATTR(size, st.size);
+SCULLD_STAT_ATTR(quanta, st.quanta);
+SCULLD_STAT_ATTR(order, st.order);
+SCULLD_STAT_ATTR(qset, st.qset);
+SCULLD_STAT_ATTR(read_bytes, st.read_bytes);
+SCULLD_STAT_ATTR(write_bytes, st.write_bytes);
+SCULLD_STAT_ATTR(read_ops, st.read_ops);
+SCULLD_STAT_ATTR(write_ops, st.write_ops);
+SCULLD_STAT_ATTR(read_avg_ns, st.read_ops ? div64_u64(st.read_ns, st.read_ops) : 0);
+SCULLD_STAT_ATTR(write_avg_ns, st.write_ops ? div64_u64(st.write_ns, st.write_ops) : 0);
+SCULLD_STAT_ATTR(read_max_ns, st.read_max_ns);
+SCULLD_STAT_ATTR(write_max_ns, st.write_max_ns);
+
+static ssize_t sculld_read_stats(struct file *filp, struct kobject *kobj,
+		struct bin_attribute *attr, char *buf, loff_t off, size_t count)
 {
+	struct device *ddev = container_of(kobj, struct device, kobj);
+	struct sculld_stats st;
+
+	if (off >= sizeof(st))
+		return 0;
+	if (count > sizeof(st) - off)
+		count = sizeof(st) - off;
+	sculld_snapshot(ddev->driver_data, &st);
+	memcpy(buf, (char *)&st + off, count);
+	return count;
+}
+
+static BIN_ATTR(stats, S_IRUGO, sculld_read_stats, NULL,
+		sizeof(struct sculld_stats));
+
+/* what the device holds compressed right now; not part of the stats */
+static ssize_t sculld_show_zbytes(struct device *ddev,
+		struct device_attribute *attr, char *buf)
+{
+	struct sculld_dev *dev = ddev->driver_data;
+
+	return sprintf(buf, "%zu\n", dev->zbytes);
+}
+
+static DEVICE_ATTR(compressed_bytes, S_IRUGO, sculld_show_zbytes, NULL);
+
+static struct attribute *sculld_attrs[] = {
+	&dev_attr_dev.attr,
+	&dev_attr_compressed_bytes.attr,
+	&dev_attr_size.attr,
+	&dev_attr_quanta.attr,
+	&dev_attr_order.attr,
+	&dev_attr_qset.attr,
+	&dev_attr_read_bytes.attr,
+	&dev_attr_write_bytes.attr,
+	&dev_attr_read_ops.attr,
+	&dev_attr_write_ops.attr,
+	&dev_attr_read_avg_ns.attr,
+	&dev_attr_write_avg_ns.attr,
+	&dev_attr_read_max_ns.attr,
+	&dev_attr_write_max_ns.attr,
+	NULL
+};
+
+static struct bin_attribute *sculld_bin_attrs[] = {
+	&bin_attr_stats,
+	NULL
+};
+
+static const struct attribute_group sculld_group = {
+	.attrs = sculld_attrs,
+	.bin_attrs = sculld_bin_attrs,
+};
+
+static const struct attribute_group *sculld_groups[] = {
+	&sculld_group,
+	NULL
+};
+
+/*
+ * The structure lives as long as its struct device: open files and
+ * sysfs users hold references to that, and the last one frees it all.
+ */
+static void sculld_dev_release(struct device *ddev)
+{
+	struct sculld_dev *dev = container_of(ddev, struct sculld_dev, ldev.dev);
+
+	flush_work(&dev->aio_work);
+	sculld_trim(dev);
+	kfree(dev);
+}
+
+static int sculld_register_dev(struct sculld_dev *dev, int index)
+{
+	int err;
+
 	sprintf(dev->devname, "sculld%d", index);
 	dev->ldev.name = dev->devname;
 	dev->ldev.driver = &sculld_driver;
 	dev->ldev.dev.driver_data = dev;
-	register_ldd_device(&dev->ldev);
-	device_create_file(&dev->ldev.dev, &dev_attr_dev);
+	dev->ldev.dev.release = sculld_dev_release;
+	/* the attributes are there by the time the uevent goes out */
+	dev->ldev.dev.groups = sculld_groups;
+	err = register_ldd_device(&dev->ldev);
+	if (err)
+		return err;
+
+	/* awake and unused: it goes to sleep after the delay */
+	pm_runtime_set_autosuspend_delay(&dev->ldev.dev, sculld_autosuspend_ms);
+	pm_runtime_use_autosuspend(&dev->ldev.dev);
+	pm_runtime_set_active(&dev->ldev.dev);
+	pm_runtime_enable(&dev->ldev.dev);
+	pm_runtime_mark_last_busy(&dev->ldev.dev);
+	pm_request_autosuspend(&dev->ldev.dev);
+	return 0;
+}
+
+/*
+ * Device lifetime. A device only costs its own structure until data
+ * is written to it, so thousands of sparse ones are cheap.
+ */
+static struct sculld_dev *sculld_create(void)
+{
+	struct sculld_dev *dev;
+	int index, err;
+
+	dev = kzalloc(sizeof(*dev), GFP_KERNEL);
+	if (!dev)
+		return ERR_PTR(-ENOMEM);
+	dev->order = sculld_order;
+	dev->qset = sculld_qset;
+	sema_init (&dev->sem, 1);
+	spin_lock_init(&dev->stats_lock);
+	spin_lock_init(&dev->aio_lock);
+	INIT_LIST_HEAD(&dev->aio_queue);
+	INIT_WORK(&dev->aio_work, sculld_do_deferred_op);
+
+	/* book the minor, but don't let open find it until we are done */
+	mutex_lock(&sculld_idr_lock);
+	index = idr_alloc(&sculld_idr, NULL, 0, sculld_max_devs, GFP_KERNEL);
+	mutex_unlock(&sculld_idr_lock);
+	if (index < 0) {
+		kfree(dev);
+		return ERR_PTR(index == -ENOSPC ? -ENFILE : index);
+	}
+
+	err = sculld_setup_cdev(dev, index);
+	if (err) {
+		mutex_lock(&sculld_idr_lock);
+		idr_remove(&sculld_idr, index);
+		mutex_unlock(&sculld_idr_lock);
+		kfree(dev);
+		return ERR_PTR(err);
+	}
+	err = sculld_register_dev(dev, index);
+	if (err) {
+		cdev_del(dev->cdev);
+		mutex_lock(&sculld_idr_lock);
+		idr_remove(&sculld_idr, index);
+		mutex_unlock(&sculld_idr_lock);
+		put_device(&dev->ldev.dev); /* frees it */
+		return ERR_PTR(err);
+	}
+
+	mutex_lock(&sculld_idr_lock);
+	idr_replace(&sculld_idr, dev, index);
+	mutex_unlock(&sculld_idr_lock);
+	return dev;
+}
+
+/* Called with the device already out of sculld_idr */
+static void sculld_destroy(struct sculld_dev *dev)
+{
+	/* suspended or not, sculld_trim frees it all in the end */
+	pm_runtime_disable(&dev->ldev.dev);
+	cdev_del(dev->cdev);
+	/* drops the registration's reference: open files keep it alive */
+	unregister_ldd_device(&dev->ldev);
+}
+
+static int sculld_new_device(struct ldd_driver *driver, const char *args)
+{
+	struct sculld_dev *dev = sculld_create();
+
+	if (IS_ERR(dev))
+		return PTR_ERR(dev);
+	PDEBUG("created %s\n", dev->devname);
+	return 0;
+}
+
+static int sculld_delete_device(struct ldd_driver *driver, const char *name)
+{
+	struct sculld_dev *dev;
+	int index;
+
+	if (sscanf(name, "sculld%d", &index) != 1)
+		return -EINVAL;
+	mutex_lock(&sculld_idr_lock);
+	dev = idr_find(&sculld_idr, index);
+	if (dev)
+		idr_remove(&sculld_idr, index);
+	mutex_unlock(&sculld_idr_lock);
+	if (!dev)
+		return -ENODEV;
+	sculld_destroy(dev);
+	return 0;
 }
 
 
@@ -477,12 +1135,15 @@ int sculld_init(void)
 	dev_t dev = MKDEV(sculld_major, 0);
 	
 	/*
-	 * Register your major, and accept a dynamic number.
+	 * Register your major, and accept a dynamic number. Keep enough
+	 * minors for the devices that will be created later on.
 	 */
+	if (sculld_max_devs < sculld_devs)
+		sculld_max_devs = sculld_devs;
 	if (sculld_major)
-		result = register_chrdev_region(dev, sculld_devs, "sculld");
+		result = register_chrdev_region(dev, sculld_max_devs, "sculld");
 	else {
-		result = alloc_chrdev_region(&dev, 0, sculld_devs, "sculld");
+		result = alloc_chrdev_region(&dev, 0, sculld_max_devs, "sculld");
 		sculld_major = MAJOR(dev);
 	}
 	if (result < 0)
@@ -493,22 +1154,24 @@ int sculld_init(void)
 	 */
 	register_ldd_driver(&sculld_driver);
 	
+	/* The AIO machinery must be ready before the devices go live */
+	sculld_aio_pool = mempool_create_kmalloc_pool(SCULLD_AIO_POOL,
+			sizeof(struct async_work));
+	sculld_aio_wq = alloc_workqueue("sculld-aio", WQ_UNBOUND | WQ_MEM_RECLAIM, 0);
+	if (!sculld_aio_pool || !sculld_aio_wq) {
+		result = -ENOMEM;
+		goto fail_aio;
+	}
+
 	/* 
 	 * allocate the devices -- we can't have them static, as the number
-	 * can be specified at load time
+	 * can be specified at load time, and more can come at run time
 	 */
-	sculld_devices = kmalloc(sculld_devs*sizeof (struct sculld_dev), GFP_KERNEL);
-	if (!sculld_devices) {
-		result = -ENOMEM;
-		goto fail_malloc;
-	}
-	memset(sculld_devices, 0, sculld_devs*sizeof (struct sculld_dev));
 	for (i = 0; i < sculld_devs; i++) {
-		sculld_devices[i].order = sculld_order;
-		sculld_devices[i].qset = sculld_qset;
-		sema_init (&sculld_devices[i].sem, 1);
-		sculld_setup_cdev(sculld_devices + i, i);
-		sculld_register_dev(sculld_devices + i, i);
+		struct sculld_dev *sdev = sculld_create();
+
+		if (IS_ERR(sdev))
+			printk(KERN_NOTICE "sculld: can't create device %d\n", i);
 	}
 
 
@@ -517,8 +1180,13 @@ int sculld_init(void)
 #endif
 	return 0; /* succeed */
 
-fail_malloc:
-	unregister_chrdev_region(dev, sculld_devs);
+fail_aio:
+	if (sculld_aio_wq)
+		destroy_workqueue(sculld_aio_wq);
+	if (sculld_aio_pool)
+		mempool_destroy(sculld_aio_pool);
+	unregister_ldd_driver(&sculld_driver);
+	unregister_chrdev_region(dev, sculld_max_devs);
 	return result;
 }
 
@@ -526,20 +1194,26 @@ fail_malloc:
 
 void sculld_cleanup(void)
 {
+	struct sculld_dev *dev;
 	int i;
 
 #ifdef SCULLD_USE_PROC
 	sculld_remove_proc();
 #endif
 
-	for (i = 0; i < sculld_devs; i++) {
-		unregister_ldd_device(&sculld_devices[i].ldev);
-		cdev_del(&sculld_devices[i].cdev);
-		sculld_trim(sculld_devices + i);
+	/* the files are all closed: this frees the devices for good */
+	mutex_lock(&sculld_idr_lock);
+	idr_for_each_entry(&sculld_idr, dev, i) {
+		idr_remove(&sculld_idr, i);
+		sculld_destroy(dev);
 	}
-	kfree(sculld_devices);
+	mutex_unlock(&sculld_idr_lock);
+	idr_destroy(&sculld_idr);
+	/* nothing can be queued any more */
+	destroy_workqueue(sculld_aio_wq);
+	mempool_destroy(sculld_aio_pool);
 	unregister_ldd_driver(&sculld_driver);
-	unregister_chrdev_region(MKDEV (sculld_major, 0), sculld_devs);
+	unregister_chrdev_region(MKDEV (sculld_major, 0), sculld_max_devs);
 }
 
 
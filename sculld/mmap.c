@@ -56,16 +56,17 @@ void sculld_vma_close(struct vm_area_struct *vma)
  * is individually decreased, and would drop to 0.
  */
 
-struct page *sculld_vma_nopage(struct vm_area_struct *vma,
-                                unsigned long address, int *type)
+vm_fault_t sculld_vma_nopage(struct vm_fault *vmf)
 {
 	unsigned long offset;
+	struct vm_area_struct *vma = vmf->vma;
 	struct sculld_dev *ptr, *dev = vma->vm_private_data;
-	struct page *page = NOPAGE_SIGBUS;
+	struct page *page;
 	void *pageptr = NULL; /* default to "missing" */
+	vm_fault_t ret = VM_FAULT_SIGBUS;
 
 	down(&dev->sem);
-	offset = (address - vma->vm_start) + (vma->vm_pgoff << PAGE_SHIFT);
+	offset = (vmf->address - vma->vm_start) + (vma->vm_pgoff << PAGE_SHIFT);
 	if (offset >= dev->size) goto out; /* out of range */
 
 	/*
@@ -78,16 +79,19 @@ struct page *sculld_vma_nopage(struct vm_area_struct *vma,
 		ptr = ptr->next;
 		offset -= dev->qset;
 	}
-	if (ptr && ptr->data) pageptr = ptr->data[offset];
+	/* a quantum resume couldn't expand is brought back now */
+	if (ptr && ptr->data && !sculld_unzip(dev, ptr, offset))
+		pageptr = ptr->data[offset];
 	if (!pageptr) goto out; /* hole or end-of-file */
 
 	/* got it, now increment the count */
+	page = virt_to_page(pageptr);
 	get_page(page);
-	if (type)
-		*type = VM_FAULT_MINOR;
+	vmf->page = page;
+	ret = 0;
   out:
 	up(&dev->sem);
-	return page;
+	return ret;
 }
 
 
@@ -95,21 +99,21 @@ struct page *sculld_vma_nopage(struct vm_area_struct *vma,
 struct vm_operations_struct sculld_vm_ops = {
 	.open =     sculld_vma_open,
 	.close =    sculld_vma_close,
-	.nopage =   sculld_vma_nopage,
+	.fault =    sculld_vma_nopage,
 };
 
 
 int sculld_mmap(struct file *filp, struct vm_area_struct *vma)
 {
-	struct inode *inode = filp->f_dentry->d_inode;
+	struct sculld_dev *dev = filp->private_data;
 
 	/* refuse to map if order is not 0 */
-	if (sculld_devices[iminor(inode)].order)
+	if (dev->order)
 		return -ENODEV;
 
 	/* don't do anything here: "nopage" will set up page table entries */
 	vma->vm_ops = &sculld_vm_ops;
-	vma->vm_flags |= VM_RESERVED;
+	vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP; /* was VM_RESERVED */
 	vma->vm_private_data = filp->private_data;
 	sculld_vma_open(vma);
 	return 0;
@@ -54,20 +54,59 @@
 #define SCULLD_ORDER    0 /* one page at a time */
 #define SCULLD_QSET     500
 
+/*
+ * Live statistics, also exported whole as the binary "stats" sysfs
+ * attribute so that a monitor gets them all with a single pread.
+ * Fixed-size fields only: this is an ABI. Latencies cover the time a
+ * read or write spends in the driver, semaphore included.
+ */
+#define SCULLD_STATS_VERSION 1
+
+struct sculld_stats {
+	__u32 version;            /* SCULLD_STATS_VERSION */
+	__u32 order;
+	__u32 qset;
+	__u32 quanta;             /* quanta allocated */
+	__u64 size;
+	__u64 read_bytes;
+	__u64 write_bytes;
+	__u64 read_ops;
+	__u64 write_ops;
+	__u64 read_ns;            /* total time in reads */
+	__u64 write_ns;
+	__u64 read_max_ns;        /* slowest read so far */
+	__u64 write_max_ns;
+};
+
+/*
+ * A quantum of an idle device, compressed by the runtime suspend
+ * callback until the device is opened again.
+ */
+struct sculld_zquantum {
+	unsigned int len;
+	char buf[];
+};
+
 struct sculld_dev {
 	void **data;
 	struct sculld_dev *next;  /* next listitem */
+	struct sculld_zquantum **zdata; /* quanta compressed while suspended */
 	int vmas;                 /* active mappings */
 	int order;                /* the current allocation order */
 	int qset;                 /* the current array size */
 	size_t size;              /* 32-bit will suffice */
+	size_t zbytes;            /* held compressed, over the list */
 	struct semaphore sem;     /* Mutual exclusion */
-	struct cdev cdev;
+	spinlock_t stats_lock;    /* protects stats */
+	struct sculld_stats stats;
+	spinlock_t aio_lock;      /* protects aio_queue */
+	struct list_head aio_queue; /* asynchronous iocbs, oldest first */
+	struct work_struct aio_work; /* drains aio_queue */
+	struct cdev *cdev;        /* our own: it may outlive the device */
 	char devname[20];
 	struct ldd_device ldev;
 };
 
-extern struct sculld_dev *sculld_devices;
 
 extern struct file_operations sculld_fops;
 
@@ -76,13 +115,16 @@ extern struct file_operations sculld_fops;
  */
 extern int sculld_major;     /* main.c */
 extern int sculld_devs;
+extern int sculld_max_devs;
 extern int sculld_order;
 extern int sculld_qset;
+extern int sculld_autosuspend_ms;
 
 /*
  * Prototypes for shared functions
  */
 int sculld_trim(struct sculld_dev *dev);
+int sculld_unzip(struct sculld_dev *dev, struct sculld_dev *dptr, int i);
 struct sculld_dev *sculld_follow(struct sculld_dev *dev, int n);
 
 
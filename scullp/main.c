@@ -22,6 +22,13 @@
 #include <linux/semaphore.h> // struct semaphore
 #include <linux/proc_fs.h>  // read_procmem
 #include <linux/seq_file.h> // seq_file stack
+#include <linux/shrinker.h> // struct shrinker
+#include <linux/atomic.h>   // writers count
+#include <linux/workqueue.h> // AIO completion worker
+#include <linux/mempool.h>  // async_work pool
+#include <linux/llist.h>    // lockless AIO queue
+#include <linux/sched/mm.h> // mmget mmput
+#include <linux/mmu_context.h> // use_mm unuse_mm
 
 #include "scullp.h"
 
@@ -35,11 +42,15 @@ int scullp_major = SCULLP_MAJOR;
 int scullp_devs  = SCULLP_DEVS;
 int scullp_qset  = SCULLP_QSET;
 int scullp_order = SCULLP_ORDER;
+int scullp_soft_limit = 0; /* bytes a cacheable device keeps under pressure */
+int scullp_fault_around = 16; /* pages mapped by a single mmap fault */
 
 module_param(scullp_major, int, S_IRUGO);
 module_param(scullp_devs, int, S_IRUGO);
 module_param(scullp_qset, int, S_IRUGO);
 module_param(scullp_order, int, S_IRUGO);
+module_param(scullp_soft_limit, int, S_IRUGO | S_IWUSR);
+module_param(scullp_fault_around, int, S_IRUGO | S_IWUSR);
 
 MODULE_AUTHOR("Zynex Victor zyy");
 MODULE_LICENSE("GPL");
@@ -48,7 +59,10 @@ MODULE_LICENSE("GPL");
  * We can't set it as static number
  */
 struct scullp_dev *scullp_devices = NULL;
+static int scullp_shrinker_on; /* registered, so unregister on cleanup */
 
+/* bytes handed back to the system by the shrinker so far */
+static atomic_long_t scullp_reclaimed = ATOMIC_LONG_INIT(0);
 
 /*
  * Empty out the scull device; must be called with the device
@@ -77,12 +91,131 @@ int scullp_trim(struct scullp_dev *dev)
         if (dptr != dev ) kfree(dptr); /* all of them but the first */
     }
     dev->size = 0;
+    dev->nquanta = 0;
+    dev->mcur = NULL;
     dev->order = scullp_order;
     dev->qset = scullp_qset;
     dev->next = NULL;
     return 0;
 }
 
+/*
+ * Memory pressure: a device marked cacheable (SCULLP_IOCTCACHE) holds
+ * data that can be recomputed by its user, so when the VM asks us to
+ * shrink we give back every page block past scullp_soft_limit bytes.
+ * Only clean devices are touched: nobody writes or maps them and the
+ * semaphore can be taken without sleeping.
+ */
+static size_t scullp_soft_bytes(void)
+{
+    return scullp_soft_limit > 0 ? scullp_soft_limit : 0;
+}
+
+static long scullp_soft_quanta(struct scullp_dev *dev)
+{
+    return DIV_ROUND_UP(scullp_soft_bytes(), PAGE_SIZE << dev->order);
+}
+
+/*
+ * Free all the quanta past the soft limit; must be called with the
+ * device semaphore held. Returns the number of bytes released.
+ */
+static long scullp_shrink_dev(struct scullp_dev *dev, long *quanta)
+{
+    struct scullp_dev *next, *prev = NULL, *dptr;
+    int qset = dev->qset;
+    long first = scullp_soft_quanta(dev); /* first quantum to go */
+    long q = 0, freed = 0, bytes = 0;
+    int i;
+
+    for (dptr = dev; dptr; dptr = next, q += qset) {
+        next = dptr->next;
+        if (dptr->data) {
+            for (i = 0; i < qset; i++) {
+                if (q + i >= first && dptr->data[i]) {
+                    free_pages((unsigned long)(dptr->data[i]), dptr->order);
+                    dptr->data[i] = NULL;
+                    bytes += PAGE_SIZE << dptr->order;
+                    freed++;
+                }
+            }
+        }
+        if (q < first || dptr == dev) { /* the first item always stays */
+            if (q >= first) {
+                kfree(dptr->data);
+                dptr->data = NULL;
+            }
+            prev = dptr;
+            continue;
+        }
+        /* the whole item is past the limit: unlink it */
+        prev->next = NULL;
+        kfree(dptr->data);
+        kfree(dptr);
+    }
+    if (dev->size > scullp_soft_bytes())
+        dev->size = scullp_soft_bytes();
+    dev->nquanta -= freed;
+    dev->mcur = NULL; /* it may point to a freed item */
+    *quanta = freed;
+    return bytes;
+}
+
+static int scullp_reclaimable(struct scullp_dev *dev)
+{
+    return dev->cacheable && !dev->vmas && !atomic_read(&dev->writers);
+}
+
+static unsigned long scullp_shrink_count(struct shrinker *shrink,
+                        struct shrink_control *sc)
+{
+    unsigned long count = 0;
+    long extra;
+    int i;
+
+    /* racy on purpose: this is only an estimate for the VM */
+    for (i = 0; i < scullp_devs; i++) {
+        struct scullp_dev *dev = scullp_devices + i;
+
+        if (!scullp_reclaimable(dev))
+            continue;
+        extra = dev->nquanta - scullp_soft_quanta(dev);
+        if (extra > 0)
+            count += extra;
+    }
+    return count;
+}
+
+static unsigned long scullp_shrink_scan(struct shrinker *shrink,
+                        struct shrink_control *sc)
+{
+    unsigned long freed = 0;
+    long n;
+    int i;
+
+    for (i = 0; i < scullp_devs && freed < sc->nr_to_scan; i++) {
+        struct scullp_dev *dev = scullp_devices + i;
+
+        if (!scullp_reclaimable(dev))
+            continue;
+        if (down_trylock(&dev->sem)) /* busy: it's not clean anyway */
+            continue;
+        if (scullp_reclaimable(dev)) {
+            atomic_long_add(scullp_shrink_dev(dev, &n), &scullp_reclaimed);
+            freed += n;
+        }
+        up(&dev->sem);
+    }
+    PDEBUG("shrinker released %lu quanta\n", freed);
+    return freed ? freed : SHRINK_STOP;
+}
+
+static struct shrinker scullp_shrinker = {
+    .count_objects = scullp_shrink_count,
+    .scan_objects  = scullp_shrink_scan,
+    .seeks         = DEFAULT_SEEKS,
+};
+
 #ifdef SCULLP_DEBUG /* Use proc filesystem if debugging */
 
 /**
@@ -128,6 +261,8 @@ static int scullp_seq_show(struct seq_file *s, void *v)
     /*scan the list*/
     seq_printf(s, "\nDevice %i: qset %i, quantum %i, sz %li\n", (int)(dev - scullp_devices),
                 qset, quantum, (long)dev->size);
+    seq_printf(s, "  cacheable %i, quanta %i, reclaimed %li (all devices)\n",
+                dev->cacheable, dev->nquanta, atomic_long_read(&scullp_reclaimed));
     for (; d; d = d->next) { /* scan the list */ 
         seq_printf(s, "  item at %p, qset at %p\n", d, d->data);
         if (d->data && !d->next) /* Dump only the last item*/
@@ -222,6 +357,9 @@ int scullp_open(struct inode *inode, struct file *filp)
         scullp_trim(dev);    /* ignore errors */
         up(&dev->sem);
     }
+    /* a device with writers is dirty: keep the shrinker away */
+    if (filp->f_mode & FMODE_WRITE)
+        atomic_inc(&dev->writers);
     /* and use filp->private_data to point to the device data */
     filp->private_data = dev; /* for other methods */ 
     return 0;       /* success */
@@ -229,6 +367,10 @@ int scullp_open(struct inode *inode, struct file *filp)
 
 int scullp_release(struct inode *inode, struct file *filp)
 {
+    struct scullp_dev *dev = filp->private_data;
+
+    if (filp->f_mode & FMODE_WRITE)
+        atomic_dec(&dev->writers);
     return 0;
 }
 
@@ -244,6 +386,7 @@ struct scullp_dev *scullp_follow(struct scullp_dev *dev, int n)
         if (!dev->next) {
             dev->next = kmalloc(sizeof(struct scullp_dev), GFP_KERNEL);
             memset(dev->next, 0, sizeof(struct scullp_dev));
+            dev->next->order = dev->order; /* same quantum all along */
         }
         dev = dev->next;
         continue;
@@ -333,10 +476,12 @@ ssize_t scullp_write(struct file *filp, const char __user *buf, size_t count,
 
     /* here is the allocation of a single quantum */
     if (!dptr->data[s_pos]) {
-        dptr->data[s_pos] = (void *)__get_free_pages(GFP_KERNEL, dptr->order);
+        dptr->data[s_pos] = (void *)__get_free_pages(GFP_KERNEL | __GFP_COMP,
+                dptr->order); /* compound, so that mmap can refcount it */
         if (!dptr->data[s_pos])
             goto out;
         memset(dptr->data[s_pos], 0, PAGE_SIZE << dptr->order);
+        dev->nquanta++;
     }
     /* write only up to the end of this quantum */
     if (count > quantum - q_pos)
@@ -364,6 +509,7 @@ out:
 long scullp_ioctl(struct file *filp,
                         unsigned int cmd, unsigned long arg)
 {
+    struct scullp_dev *dev = filp->private_data;
     int err = 0, tmp;
     int retval = 0;
 
@@ -462,6 +608,16 @@ long scullp_ioctl(struct file *filp,
         scullp_qset = arg;
         return tmp;
 
+    case SCULLP_IOCTCACHE: /* Tell: mark this device reclaimable or not */
+        if (down_interruptible(&dev->sem))
+            return -ERESTARTSYS;
+        dev->cacheable = !!arg;
+        up(&dev->sem);
+        break;
+
+    case SCULLP_IOCQCACHE: /* Query: is this device a cache? */
+        return dev->cacheable;
+
         /*
          * The following two change the buffer size for scullpipe.
          * The scullpipe device uses this same ioctl method, just to
@@ -516,24 +672,72 @@ loff_t  scullp_llseek(struct file *filp, loff_t off, int whence)
  */
 /*
  * A simple asynchronous I/O implementation.
+ *
+ * Asynchronous iocbs are queued on a lockless list and a single work
+ * item on our own workqueue drains the whole list at each run: the
+ * copy really happens in the worker, borrowing the submitter's mm, and
+ * many completions are delivered per wakeup. The descriptors come from
+ * a mempool so that submission never fails for lack of memory.
  */
+#define SCULLP_AIO_POOL 64 /* async_work kept in reserve */
 
 struct async_work {
 	struct kiocb *iocb;
-	int result;
-	struct delayed_work work;
+	int write;
+	struct iov_iter iter;     /* private copy of the caller's iterator */
+	const void *iov;          /* segment array behind iter */
+	struct mm_struct *mm;     /* whose user buffers iter points to */
+	struct llist_node node;
 };
 
+static struct workqueue_struct *scullp_aio_wq;
+static mempool_t *scullp_aio_pool;
+static LLIST_HEAD(scullp_aio_list);
+
+static int scullp_aio_write_temp(struct kiocb *iocb, struct iov_iter *iov);
+static int scullp_aio_read_temp(struct kiocb *iocb, struct iov_iter *iov);
+
 /*
- * "Complete" an asynchronous operation.
+ * Perform and "complete" all the queued asynchronous operations.
  */
 static void scullp_do_deferred_op(struct work_struct *p)
 {
-	struct async_work *stuff = (struct async_work *)container_of(to_delayed_work(p), struct async_work, work);
-	stuff->iocb->ki_complete(stuff->iocb, stuff->result, 0);
-	kfree(stuff);
+	struct llist_node *list;
+	struct async_work *stuff, *next;
+	struct mm_struct *mm = NULL;
+	int result;
+
+	/* the list is LIFO, give the iocbs back in submission order */
+	list = llist_reverse_order(llist_del_all(&scullp_aio_list));
+	llist_for_each_entry_safe(stuff, next, list, node) {
+		/* switch address space only when the submitter changes */
+		if (stuff->mm != mm) {
+			if (mm) {
+				unuse_mm(mm);
+				mmput(mm);
+			}
+			mm = stuff->mm;
+			use_mm(mm);
+		} else {
+			mmput(stuff->mm); /* we hold one reference already */
+		}
+
+		if (stuff->write)
+			result = scullp_aio_write_temp(stuff->iocb, &stuff->iter);
+		else
+			result = scullp_aio_read_temp(stuff->iocb, &stuff->iter);
+		kfree(stuff->iov);
+		stuff->iocb->ki_complete(stuff->iocb, result, 0);
+		mempool_free(stuff, scullp_aio_pool);
+	}
+	if (mm) {
+		unuse_mm(mm);
+		mmput(mm);
+	}
 }
 
+static DECLARE_WORK(scullp_aio_work, scullp_do_deferred_op);
+
 static int scullp_aio_write_temp(struct kiocb *iocb, struct iov_iter *iov)
 {
     struct scullp_dev *dev = iocb->ki_filp->private_data;
@@ -565,16 +769,18 @@ static int scullp_aio_write_temp(struct kiocb *iocb, struct iov_iter *iov)
 
     /* here is the allocation of a single quantum */
     if (!dptr->data[s_pos]) {
-        dptr->data[s_pos] = (void *)__get_free_pages(GFP_KERNEL, dptr->order);
+        dptr->data[s_pos] = (void *)__get_free_pages(GFP_KERNEL | __GFP_COMP,
+                dptr->order); /* compound, so that mmap can refcount it */
         if (!dptr->data[s_pos])
             goto out;
         memset(dptr->data[s_pos], 0, PAGE_SIZE << dptr->order);
+        dev->nquanta++;
     }
     /* write only up to the end of this quantum */
     if (count > quantum - q_pos)
         count = quantum - q_pos;
     
-    if (copy_from_iter(dptr->data[s_pos] + q_pos, count, iov)) {
+    if (copy_from_iter(dptr->data[s_pos] + q_pos, count, iov) != count) {
         retval = -EFAULT;
         goto out;
     }
@@ -626,7 +832,7 @@ static int scullp_aio_read_temp(struct kiocb *iocb, struct iov_iter *iov)
     if (count > quantum - q_pos)
         count = quantum - q_pos;
     
-    if (copy_to_iter(dptr->data[s_pos] + q_pos, count, iov)) {
+    if (copy_to_iter(dptr->data[s_pos] + q_pos, count, iov) != count) {
         retval = -EFAULT;
         goto nothing;
     }
@@ -642,27 +848,35 @@ nothing:
 static int scullp_defer_op(int write, struct kiocb *iocb, struct iov_iter *iov)
 {
 	struct async_work *stuff;
-	int result;
 
-	/* Copy now while we can access the buffer */
-	if (write)
-		result = scullp_aio_write_temp(iocb, iov);
-	else
-		result = scullp_aio_read_temp(iocb, iov);
-
-	/* If this is a synchronous IOCB, we return our status now. */
-	if (is_sync_kiocb(iocb))
-		return result;
-
-	/* Otherwise defer the completion for a few milliseconds. */
-	stuff = kmalloc (sizeof (*stuff), GFP_KERNEL);
-	if (stuff == NULL)
-		return result; /* No memory, just complete now */
+	/* If this is a synchronous IOCB, just do it now. */
+	if (is_sync_kiocb(iocb) || !current->mm)
+		goto sync;
+
+	/*
+	 * Otherwise hand it to the worker. The caller frees its segment
+	 * array as soon as we return, so we keep a copy of our own.
+	 */
+	stuff = mempool_alloc(scullp_aio_pool, GFP_KERNEL);
+	stuff->iov = dup_iter(&stuff->iter, iov, GFP_KERNEL);
+	if (!stuff->iov && iov_iter_count(iov)) {
+		mempool_free(stuff, scullp_aio_pool);
+		goto sync; /* No memory, just complete now */
+	}
 	stuff->iocb = iocb;
-	stuff->result = result;
-	INIT_DELAYED_WORK(&stuff->work, scullp_do_deferred_op);
-	schedule_delayed_work(&stuff->work, HZ/100);
+	stuff->write = write;
+	stuff->mm = current->mm;
+	mmget(stuff->mm);
+
+	/* only the first entry of a batch needs to kick the worker */
+	if (llist_add(&stuff->node, &scullp_aio_list))
+		queue_work(scullp_aio_wq, &scullp_aio_work);
 	return -EIOCBQUEUED;
+
+sync:
+	if (write)
+		return scullp_aio_write_temp(iocb, iov);
+	return scullp_aio_read_temp(iocb, iov);
 }
 
 
@@ -726,6 +940,10 @@ static void scullp_cleanup_module(void)
     int i;
     dev_t devno = MKDEV(scullp_major, 0);
 
+    /* Nothing may walk the devices after this point */
+    if (scullp_shrinker_on)
+        unregister_shrinker(&scullp_shrinker);
+
     /* Get rid of our char dev entries */
     if (scullp_devices) {
         for (i = 0; i < scullp_devs; i++) {
@@ -738,6 +956,11 @@ static void scullp_cleanup_module(void)
 #ifdef SCULLP_DEBUG /* use proc only if debugging */
     scullp_remove_proc();
 #endif
+    /* run the queued iocbs to completion before the pool goes away */
+    if (scullp_aio_wq)
+        destroy_workqueue(scullp_aio_wq);
+    if (scullp_aio_pool)
+        mempool_destroy(scullp_aio_pool);
 	/* cleanup_module is never called if registering failed */
     unregister_chrdev_region(devno, scullp_devs);
 }
@@ -785,14 +1008,29 @@ static int __init scullp_init_module(void)
      */
     memset(scullp_devices, 0, sizeof(struct scullp_dev) * scullp_devs);
 
+    /* The AIO machinery must be there before the devices go live */
+    scullp_aio_pool = mempool_create_kmalloc_pool(SCULLP_AIO_POOL,
+            sizeof(struct async_work));
+    scullp_aio_wq = alloc_workqueue("scullp-aio", WQ_UNBOUND | WQ_MEM_RECLAIM, 1);
+    if (!scullp_aio_pool || !scullp_aio_wq) {
+        result = -ENOMEM;
+        goto fail_aio;
+    }
+
     /* Initialize each device */
     for (i = 0; i < scullp_devs; i++) {
         scullp_devices[i].order = scullp_order;
         scullp_devices[i].qset = scullp_qset;
         sema_init(&scullp_devices[i].sem, 1);   // semaphore value is one
+        atomic_set(&scullp_devices[i].writers, 0);
         scullp_setup_cdev(&scullp_devices[i], i);
     }
 
+    /* Let the VM reclaim cacheable devices when memory is short */
+    result = register_shrinker(&scullp_shrinker);
+    if (result)
+        goto fail_shrinker;
+    scullp_shrinker_on = 1;
 
 #ifdef SCULLP_DEBUG
     scullp_create_proc(); /* Only when debugging */
@@ -800,8 +1038,21 @@ static int __init scullp_init_module(void)
 
     return 0; /* Succeed */
 
+    /* undo only what was done: no proc file yet, no cdev before the loop */
+fail_shrinker:
+    for (i = 0; i < scullp_devs; i++)
+        cdev_del(&scullp_devices[i].cdev);
+fail_aio:
+    if (scullp_aio_wq)
+        destroy_workqueue(scullp_aio_wq);
+    if (scullp_aio_pool)
+        mempool_destroy(scullp_aio_pool);
+    scullp_aio_wq = NULL;
+    scullp_aio_pool = NULL;
+    kfree(scullp_devices);
+    scullp_devices = NULL;
 fail_malloc:
-    scullp_cleanup_module();
+    unregister_chrdev_region(dev, scullp_devs);
     return result;
 }
 
@@ -43,51 +43,118 @@ void scullp_vma_close(struct vm_area_struct *vma)
 	dev->vmas--;
 }
 
+/*
+ * Find list item number "item" without allocating anything. Faults
+ * on a mapping tend to move forward, so the walk starts from the item
+ * found last time when it can. Called with the semaphore held.
+ */
+static struct scullp_dev *scullp_mmap_follow(struct scullp_dev *dev,
+		unsigned long item)
+{
+	struct scullp_dev *ptr = dev;
+	unsigned long n = 0;
+
+	if (dev->mcur && dev->mcur_item <= item) {
+		ptr = dev->mcur;
+		n = dev->mcur_item;
+	}
+	for (; ptr && n < item; n++)
+		ptr = ptr->next;
+	if (ptr) {
+		dev->mcur = ptr;
+		dev->mcur_item = n;
+	}
+	return ptr;
+}
+
+static void *scullp_mmap_quantum(struct scullp_dev *dev, unsigned long qidx)
+{
+	struct scullp_dev *ptr = scullp_mmap_follow(dev, qidx / dev->qset);
+
+	if (!ptr || !ptr->data)
+		return NULL;
+	return ptr->data[qidx % dev->qset];
+}
+
 /*
  * The nopage method: the core of the file. It retrieves the
- * page required from the scullp device and returns it to the
- * user. The count for the page must be incremented, because
- * it is automatically decremented at page unmap.
+ * page required from the scullp device and maps it for the user.
+ * The count for the page must be incremented, because it is
+ * automatically decremented at page unmap.
  *
- * For this reason, "order" must be zero. Otherwise, only the first
- * page has its count incremented, and the allocating module must
- * release it as a whole block. Therefore, it isn't possible to map
- * pages from a multipage block: when they are unmapped, their count
- * is individually decreased, and would drop to 0.
+ * With "order" bigger than zero, only the first page of a plain
+ * multipage block has a count, and unmapping its other pages would
+ * drop theirs to 0. So the quanta are allocated as compound pages
+ * (__GFP_COMP): any page of the block then takes a reference on the
+ * head, and the block goes back as a whole at trim time.
+ *
+ * One fault maps the whole faulting quantum, and then keeps going
+ * over the following quanta up to scullp_fault_around pages (fault
+ * around), stopping at the first hole. A sequential scan of the
+ * mapping thus faults once every scullp_fault_around pages at most.
  */
 //	vm_fault_t (*fault)(struct vm_fault *vmf);
 vm_fault_t scullp_vma_nopage(struct vm_fault *vmf)
 {
-	unsigned long offset;
-	struct scullp_dev *ptr, *dev = vmf->vma->vm_private_data;
-	struct page *page = VM_FAULT_SIGBUS;
-	void *pageptr = NULL; /* default to "missing" */
-
-	down(&dev->sem);
-	offset = (vmf->address - vmf->vma->vm_start) + (vmf->vma->vm_pgoff << PAGE_SHIFT);
-	if (offset >= dev->size) goto out; /* out of range */
+	struct vm_area_struct *vma = vmf->vma;
+	struct scullp_dev *dev = vma->vm_private_data;
+	unsigned long pgoff, start, end, last, qidx, addr;
+	int npages = 1 << dev->order; /* pages per quantum */
+	vm_fault_t ret = VM_FAULT_SIGBUS;
+	void *pageptr;
+	int err;
 
 	/*
-	 * Now retrieve the scullp device from the list,then the page.
-	 * If the device has holes, the process receives a SIGBUS when
-	 * accessing the hole.
+	 * A killed task must not get NOPAGE: a kernel-mode uaccess fault
+	 * would just retry forever. SIGBUS fails the copy instead.
 	 */
-	offset >>= PAGE_SHIFT; /* offset is a number of pages */
-	for (ptr = dev; ptr && offset >= dev->qset;) {
-		ptr = ptr->next;
-		offset -= dev->qset;
+	if (down_killable(&dev->sem))
+		return VM_FAULT_SIGBUS;
+	pgoff = ((vmf->address - vma->vm_start) >> PAGE_SHIFT) + vma->vm_pgoff;
+	if ((pgoff << PAGE_SHIFT) >= dev->size) goto out; /* out of range */
+
+	/* the window: whole quanta, within the vma and the device */
+	start = pgoff & ~(unsigned long)(npages - 1);
+	end = pgoff + max(scullp_fault_around, 1);
+	end = ALIGN(end, npages);
+	last = vma->vm_pgoff + vma_pages(vma);
+	if (end > last)
+		end = last;
+	last = DIV_ROUND_UP(dev->size, PAGE_SIZE);
+	if (end > last)
+		end = last;
+	if (start < vma->vm_pgoff)
+		start = vma->vm_pgoff;
+
+	while (start < end) {
+		/*
+		 * Now retrieve the quantum from the list. If the device has
+		 * holes, the process receives a SIGBUS when accessing one.
+		 */
+		qidx = start >> dev->order;
+		pageptr = scullp_mmap_quantum(dev, qidx);
+		if (!pageptr)
+			break; /* hole or end-of-file */
+		pageptr += (start & (npages - 1)) << PAGE_SHIFT;
+		addr = vma->vm_start + ((start - vma->vm_pgoff) << PAGE_SHIFT);
+
+		/* map what we need of it; vm_insert_page takes the reference */
+		for (; start < end && start >> dev->order == qidx; start++) {
+			err = vm_insert_page(vma, addr, virt_to_page(pageptr));
+			if (err && err != -EBUSY) { /* -EBUSY: already mapped */
+				ret = vmf_error(err);
+				goto out;
+			}
+			if (start == pgoff)
+				ret = VM_FAULT_NOPAGE; /* the one that was asked */
+			pageptr += PAGE_SIZE;
+			addr += PAGE_SIZE;
+		}
 	}
-	if (ptr && ptr->data) pageptr = ptr->data[offset];
-	if (!pageptr) goto out; /* hole or end-of-file */
-	page = virt_to_page(pageptr);
-
-	/* got it, now increment the count */
-	get_page(page);
-    vmf->page = page;
  out:
 	up(&dev->sem);
 
-	return VM_FAULT_LOCKED;
+	return ret;
 }
 
 
@@ -101,15 +168,10 @@ struct vm_operations_struct scullp_vm_ops = {
 
 int scullp_mmap(struct file *filp, struct vm_area_struct *vma)
 {
-	struct inode *inode = filp->f_inode;
-
-	/* refuse to map if order is not 0 */
-	if (scullp_devices[iminor(inode)].order)
-		return -ENODEV;
-
 	/* don't do anything here: "nopage" will set up page table entries */
 	vma->vm_ops = &scullp_vm_ops;
-	vma->vm_flags |= VM_LOCKED;
+	/* MIXEDMAP now, as vm_insert_page can't set it from the fault path */
+	vma->vm_flags |= VM_LOCKED | VM_MIXEDMAP;
 	vma->vm_private_data = filp->private_data;
 	scullp_vma_open(vma);
 	return 0;
@@ -65,6 +65,11 @@ struct scullp_dev {
 	int order;                /* the current allocation order */
 	int qset;                 /* the current array size */
 	size_t size;              /* 32-bit will suffice */
+	int cacheable;            /* may be reclaimed under pressure */
+	int nquanta;              /* quanta allocated over the list */
+	atomic_t writers;         /* opens with FMODE_WRITE */
+	struct scullp_dev *mcur;  /* fault path: last list item visited */
+	unsigned long mcur_item;  /* ... and its index in the list */
 	struct semaphore sem;     /* Mutual exclusion */
 	struct cdev cdev;
 };
@@ -86,6 +91,8 @@ extern int scullp_major;     /* main.c */
 extern int scullp_devs;
 extern int scullp_order;
 extern int scullp_qset;
+extern int scullp_soft_limit;
+extern int scullp_fault_around;
 
 
 /*
@@ -128,6 +135,14 @@ struct scullp_dev *scullp_follow(struct scullp_dev *dev, int n);
 #define SCULLP_IOCHQSET    _IO(SCULLP_IOC_MAGIC,  12)
 
 
-#define SCULLP_IOC_MAXNR 12
+/*
+ * Per-device knobs: these act on the open device, not on the globals.
+ * CACHE marks the device as a cache tier the shrinker may trim back
+ * to scullp_soft_limit bytes when the system runs short of memory.
+ */
+#define SCULLP_IOCTCACHE    _IO(SCULLP_IOC_MAGIC,  13)
+#define SCULLP_IOCQCACHE    _IO(SCULLP_IOC_MAGIC,  14)
+
+#define SCULLP_IOC_MAXNR 14
 
 #endif /* _SCULL_H_ */
@@ -23,6 +23,9 @@
 #include <linux/semaphore.h> // struct semaphore
 #include <linux/proc_fs.h>  // read_procmem
 #include <linux/seq_file.h> // seq_file stack
+#include <linux/mm.h>       // alloc_page
+#include <linux/ktime.h>    // allocation benchmark
+#include <linux/version.h>  // alloc_pages_bulk
 
 #include "scull.h"
 
@@ -36,11 +39,19 @@ int scullv_major = SCULLV_MAJOR;
 int scullv_devs  = SCULLV_DEVS;
 int scullv_qset  = SCULLV_QSET;
 int scullv_order = SCULLV_ORDER;
+int scullv_flat  = 0; /* whole device as one region, taken at trim */
+int scullv_huge  = 0; /* try PMD mappings for the quanta */
+int scullv_flat_max = SCULLV_FLAT_MAX; /* MB, checked at load */
 
 module_param(scullv_major, int, S_IRUGO);
 module_param(scullv_devs, int, S_IRUGO);
 module_param(scullv_qset, int, S_IRUGO);
 module_param(scullv_order, int, S_IRUGO);
+module_param(scullv_flat, int, S_IRUGO | S_IWUSR);
+module_param(scullv_huge, int, S_IRUGO | S_IWUSR);
+module_param(scullv_flat_max, int, S_IRUGO);
+
+static unsigned long scullv_flat_bytes; /* scullv_flat_max, in bytes */
 
 MODULE_AUTHOR("Zynex Victor zyy");
 MODULE_LICENSE("GPL");
@@ -51,6 +62,178 @@ MODULE_LICENSE("GPL");
 struct scullv_dev *scullv_devices = NULL;
 
 
+/*
+ * With scullv_huge, a quantum of at least PMD_SIZE is asked to the
+ * vmalloc huge mapping support, so that random accesses to it go
+ * through one TLB entry per PMD instead of one per page. The page
+ * array is then only a lookup table for mmap. Returns 0 when the
+ * kernel can't do it, and the caller goes the 4k way.
+ */
+static int scullv_alloc_huge(struct scullv_quantum *q, gfp_t gfp)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 18, 0)
+    unsigned int i;
+
+    if (!scullv_huge || ((unsigned long)q->npages << PAGE_SHIFT) < PMD_SIZE)
+        return 0;
+    q->addr = vmalloc_huge((unsigned long)q->npages << PAGE_SHIFT, gfp);
+    if (!q->addr)
+        return 0;
+    for (i = 0; i < q->npages; i++)
+        q->pages[i] = vmalloc_to_page(q->addr + i * PAGE_SIZE);
+    q->huge = 1;
+    return 1;
+#else
+    return 0; /* no huge vmalloc mappings before 5.18 */
+#endif
+}
+
+/*
+ * Quantum allocation: grab the pages (in one go where the kernel
+ * offers a bulk allocator), then vmap them for our own accesses.
+ */
+struct scullv_quantum *scullv_alloc_quantum(int order)
+{
+    struct scullv_quantum *q;
+    unsigned int i, n = 1 << order;
+    gfp_t gfp = GFP_KERNEL | __GFP_ZERO;
+
+    q = kzalloc(sizeof(*q) + n * sizeof(struct page *), GFP_KERNEL);
+    if (!q)
+        return NULL;
+    q->npages = n;
+    if (scullv_alloc_huge(q, gfp))
+        return q;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 13, 0)
+    i = alloc_pages_bulk_array(gfp, n, q->pages);
+#else
+    i = 0;
+#endif
+    for (; i < n; i++) { /* whatever the bulk allocator left us */
+        q->pages[i] = alloc_page(gfp);
+        if (!q->pages[i])
+            goto fail;
+    }
+    q->addr = vmap(q->pages, n, VM_MAP, PAGE_KERNEL);
+    if (!q->addr)
+        goto fail;
+    return q;
+
+fail:
+    scullv_free_quantum(q);
+    return NULL;
+}
+
+void scullv_free_quantum(struct scullv_quantum *q)
+{
+    unsigned int i;
+
+    if (q->huge) {
+        vfree(q->addr);
+        kfree(q);
+        return;
+    }
+    if (q->addr)
+        vunmap(q->addr);
+    for (i = 0; i < q->npages; i++)
+        if (q->pages[i])
+            __free_page(q->pages[i]);
+    kfree(q);
+}
+
+/*
+ * Flat mode: the device is a single growable region. The pages are
+ * kept in one array and vmap'ed as a whole, so read and write are a
+ * plain copy with no quantum boundary, and mmap sees the same flat
+ * space. Growing means mapping the region again; the region grows
+ * by half each time so that the remapping cost stays linear, up to
+ * scullv_flat_max MB. User mappings point at the pages, not at the
+ * kernel view, so they survive a remap.
+ */
+static int scullv_flat_grow(struct scullv_dev *dev, size_t size)
+{
+    unsigned long i, need = DIV_ROUND_UP(size, PAGE_SIZE), want;
+    struct page **pages;
+    void *addr;
+
+    if (need <= dev->fnr)
+        return 0;
+    want = max(need, dev->fnr + dev->fnr / 2);
+    want = ALIGN(want, 1UL << dev->order); /* never less than a quantum */
+    want = max(need, min(want, scullv_flat_bytes >> PAGE_SHIFT));
+    pages = kvmalloc_array(want, sizeof(struct page *), GFP_KERNEL);
+    if (!pages)
+        return -ENOMEM;
+    if (dev->fnr)
+        memcpy(pages, dev->fpages, dev->fnr * sizeof(struct page *));
+    for (i = dev->fnr; i < want; i++) {
+        pages[i] = alloc_page(GFP_KERNEL | __GFP_ZERO);
+        if (!pages[i])
+            goto fail;
+    }
+    addr = vmap(pages, want, VM_MAP, PAGE_KERNEL);
+    if (!addr)
+        goto fail;
+
+    if (dev->faddr)
+        vunmap(dev->faddr);
+    kvfree(dev->fpages);
+    dev->fpages = pages;
+    dev->faddr = addr;
+    dev->fnr = want;
+    return 0;
+
+fail:
+    while (i-- > dev->fnr)
+        __free_page(pages[i]);
+    kvfree(pages);
+    return -ENOMEM;
+}
+
+static void scullv_flat_trim(struct scullv_dev *dev)
+{
+    unsigned long i;
+
+    if (dev->faddr)
+        vunmap(dev->faddr);
+    for (i = 0; i < dev->fnr; i++)
+        __free_page(dev->fpages[i]);
+    kvfree(dev->fpages);
+    dev->fpages = NULL;
+    dev->faddr = NULL;
+    dev->fnr = 0;
+}
+
+static ssize_t scullv_flat_read(struct scullv_dev *dev, char __user *buf,
+                        size_t count, loff_t *f_pos)
+{
+    if (*f_pos < 0 || *f_pos >= dev->size)
+        return 0;
+    if (count > dev->size - *f_pos)
+        count = dev->size - *f_pos;
+    if (copy_to_user(buf, dev->faddr + *f_pos, count))
+        return -EFAULT;
+    *f_pos += count;
+    return count;
+}
+
+static ssize_t scullv_flat_write(struct scullv_dev *dev, const char __user *buf,
+                        size_t count, loff_t *f_pos)
+{
+    /* checked in loff_t: the sum wraps in a 32-bit size_t */
+    if (*f_pos < 0 || *f_pos > scullv_flat_bytes ||
+            count > scullv_flat_bytes - *f_pos)
+        return -EFBIG;
+    if (scullv_flat_grow(dev, *f_pos + count))
+        return -ENOMEM;
+    if (copy_from_user(dev->faddr + *f_pos, buf, count))
+        return -EFAULT;
+    *f_pos += count;
+    if (dev->size < *f_pos)
+        dev->size = *f_pos;
+    return count;
+}
+
 /*
  * Empty out the scull device; must be called with the device
  * semaphore held.
@@ -63,12 +246,13 @@ int scullv_trim(struct scullv_dev *dev)
 
     if (dev->vmas) /* don't trim there are avtive mappings */
         return -EBUSY;
+    scullv_flat_trim(dev);
     for (dptr = dev; dptr; dptr = next) { /* iterate all the list items */
         if (dptr->data) {
             for (i = 0; i < qset; i++){
                 if (dptr->data[i]) {
                     //kfree(dptr->data[i]);
-                    vfree(dptr->data[i]);
+                    scullv_free_quantum(dptr->data[i]);
                 }
             }
             kfree(dptr->data);
@@ -78,6 +262,7 @@ int scullv_trim(struct scullv_dev *dev)
         if (dptr != dev ) kfree(dptr); /* all of them but the first */
     }
     dev->size = 0;
+    dev->flat = scullv_flat;
     dev->order = scullv_order;
     dev->qset = scullv_qset;
     dev->next = NULL;
@@ -129,13 +314,18 @@ static int scullv_seq_show(struct seq_file *s, void *v)
     /*scan the list*/
     seq_printf(s, "\nDevice %i: qset %i, quantum %i, sz %li\n", (int)(dev - scullv_devices),
                 qset, quantum, (long)dev->size);
+    if (dev->flat)
+        seq_printf(s, "  flat at %p, %lu pages\n",
+                    dev->faddr, dev->fnr);
     for (; d; d = d->next) { /* scan the list */ 
         seq_printf(s, "  item at %p, qset at %p\n", d, d->data);
         if (d->data && !d->next) /* Dump only the last item*/
             for (i = 0; i < dev->qset; i++) {
-                if (d->data[i]) 
-                    seq_printf(s, "    % 4i: %8p\n",
-                                i, d->data[i]);
+                struct scullv_quantum *q = d->data[i];
+
+                if (q)
+                    seq_printf(s, "    % 4i: %8p (%u pages%s)\n",
+                                i, q->addr, q->npages, q->huge ? ", huge" : "");
             }
     }
     up(&dev->sem);
@@ -184,6 +374,62 @@ static struct file_operations scullv_proc_ops = {
 /**
  * Actually create and remove the /proc file(s).
  */
+/*
+ * /proc/scullvbench: time the allocation of 1MB quanta, the old way
+ * (vzalloc) against the page array one. Each read runs the loop.
+ */
+#define SCULLV_BENCH_ORDER  (20 - PAGE_SHIFT) /* 1MB */
+#define SCULLV_BENCH_LOOPS  32
+
+static int scullv_bench_show(struct seq_file *s, void *v)
+{
+    struct scullv_quantum *q;
+    void *p;
+    u64 t0, alloc = 0, release = 0;
+    int i;
+
+    for (i = 0; i < SCULLV_BENCH_LOOPS; i++) {
+        t0 = ktime_get_ns();
+        p = vzalloc(PAGE_SIZE << SCULLV_BENCH_ORDER);
+        alloc += ktime_get_ns() - t0;
+        if (!p)
+            return -ENOMEM;
+        t0 = ktime_get_ns();
+        vfree(p);
+        release += ktime_get_ns() - t0;
+    }
+    seq_printf(s, "vzalloc 1MB:    alloc %llu ns, free %llu ns\n",
+                div_u64(alloc, SCULLV_BENCH_LOOPS), div_u64(release, SCULLV_BENCH_LOOPS));
+
+    alloc = release = 0;
+    for (i = 0; i < SCULLV_BENCH_LOOPS; i++) {
+        t0 = ktime_get_ns();
+        q = scullv_alloc_quantum(SCULLV_BENCH_ORDER);
+        alloc += ktime_get_ns() - t0;
+        if (!q)
+            return -ENOMEM;
+        t0 = ktime_get_ns();
+        scullv_free_quantum(q);
+        release += ktime_get_ns() - t0;
+    }
+    seq_printf(s, "page array 1MB: alloc %llu ns, free %llu ns\n",
+                div_u64(alloc, SCULLV_BENCH_LOOPS), div_u64(release, SCULLV_BENCH_LOOPS));
+    return 0;
+}
+
+static int scullv_bench_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, scullv_bench_show, NULL);
+}
+
+static struct file_operations scullv_bench_ops = {
+    .owner      = THIS_MODULE,
+    .open       = scullv_bench_open,
+    .read       = seq_read,
+    .llseek     = seq_lseek,
+    .release    = single_release
+};
+
 static void scullv_create_proc(void)
 {
     struct proc_dir_entry *entry;
@@ -195,6 +441,7 @@ static void scullv_create_proc(void)
     #endif
     /* create_proc_entry is deprecated since kernel version3.1 now is changed to proc_create*/
     entry = proc_create("scullvseq", 0, NULL, &scullv_proc_ops); 
+    entry = proc_create("scullvbench", 0, NULL, &scullv_bench_ops);
 }
 
 static void scullv_remove_proc(void)
@@ -202,6 +449,7 @@ static void scullv_remove_proc(void)
     /* no problem if it was not registered */
     //remove_proc_entry("scullmem", NULL /* parent dir */);
     remove_proc_entry("scullvseq", NULL);
+    remove_proc_entry("scullvbench", NULL);
 }
 #endif /* SCULL_DEBUG */
 
@@ -260,6 +508,7 @@ ssize_t scullv_read(struct file *flip, char __user *buf, size_t count,
     /* f_pos is the position calculated by kernel */
     struct scullv_dev *dev = flip->private_data;
     struct scullv_dev *dptr; /* the first listitem */
+    struct scullv_quantum *q;
     int quantum = PAGE_SIZE << dev->order, qset = dev->qset;
     int itemsize = quantum * qset; /* how many bytes in the listitem */
     int item, s_pos, q_pos, rest;
@@ -268,6 +517,10 @@ ssize_t scullv_read(struct file *flip, char __user *buf, size_t count,
     /* for semaphore down and up */
     if (down_interruptible(&dev->sem))
         return -ERESTARTSYS;
+    if (dev->flat) {
+        retval = scullv_flat_read(dev, buf, count, f_pos);
+        goto nothing;
+    }
     if (*f_pos >= dev->size)
         goto nothing;
     if (*f_pos + count > dev->size)
@@ -285,12 +538,13 @@ ssize_t scullv_read(struct file *flip, char __user *buf, size_t count,
         goto nothing;
     if (!dptr->data[s_pos])
         goto nothing;
+    q = dptr->data[s_pos];
 
     /* read only up to the end of this quantum */
     if (count > quantum - q_pos)
         count = quantum - q_pos;
     
-    if (copy_to_user(buf, dptr->data[s_pos] + q_pos, count)) {
+    if (copy_to_user(buf, q->addr + q_pos, count)) {
         retval = -EFAULT;
         goto nothing;
     }
@@ -308,6 +562,7 @@ ssize_t scullv_write(struct file *filp, const char __user *buf, size_t count,
 {
     struct scullv_dev *dev = filp->private_data;
     struct scullv_dev *dptr;
+    struct scullv_quantum *q;
     int quantum = PAGE_SIZE << dev->order, qset = dev->qset;
     int itemsize = quantum * qset;
     int item, s_pos, q_pos, rest;
@@ -315,6 +570,10 @@ ssize_t scullv_write(struct file *filp, const char __user *buf, size_t count,
 
     if (down_interruptible(&dev->sem)) 
         return -ERESTARTSYS;
+    if (dev->flat) {
+        retval = scullv_flat_write(dev, buf, count, f_pos);
+        goto out;
+    }
     
     /* find listitem, qset index and offset in the quantum */
     item = (long)*f_pos / itemsize;
@@ -332,18 +591,18 @@ ssize_t scullv_write(struct file *filp, const char __user *buf, size_t count,
         memset(dptr->data, 0, qset * sizeof(char *));
     }
 
-    /* here is the allocation of a single quantum */
+    /* here is the allocation of a single quantum (zeroed already) */
     if (!dptr->data[s_pos]) {
-        dptr->data[s_pos] = (void *)vmalloc(GFP_KERNEL);
+        dptr->data[s_pos] = scullv_alloc_quantum(dev->order);
         if (!dptr->data[s_pos])
             goto out;
-        memset(dptr->data[s_pos], 0, PAGE_SIZE << dptr->order);
     }
+    q = dptr->data[s_pos];
     /* write only up to the end of this quantum */
     if (count > quantum - q_pos)
         count = quantum - q_pos;
     
-    if (copy_from_user(dptr->data[s_pos] + q_pos, buf, count)) {
+    if (copy_from_user(q->addr + q_pos, buf, count)) {
         retval = -EFAULT;
         goto out;
     }
@@ -523,6 +782,11 @@ static ssize_t scullv_aio_write(struct kiocb *iocb, struct iov_iter *iov)
 
 }
 
+/*
+ * Mmap *is* available, but confined in a different file
+ */
+extern int scullv_mmap(struct file *filp, struct vm_area_struct *vma);
+
 //ssize_t (*read_iter) (struct kiocb *, struct iov_iter *);
 //ssize_t (*write_iter) (struct kiocb *, struct iov_iter *);
 struct file_operations scullv_fops = {
@@ -535,6 +799,7 @@ struct file_operations scullv_fops = {
     .release =  scullv_release,
     .read_iter = scullv_aio_read,
     .write_iter = scullv_aio_write,
+    .mmap = scullv_mmap,
 };
 
 
@@ -589,6 +854,14 @@ static int __init scullv_init_module(void)
     int result, i;
     dev_t dev = 0;
 
+    /* the flat view is one vmap: it must fit in the vmalloc area */
+    if (scullv_flat_max < 1 || scullv_flat_max > (VMALLOC_TOTAL >> 20)) {
+        printk(KERN_WARNING "scullv: flat_max %d MB, vmalloc area is %lu MB\n",
+                scullv_flat_max, (unsigned long)(VMALLOC_TOTAL >> 20));
+        return -EINVAL;
+    }
+    scullv_flat_bytes = (unsigned long)scullv_flat_max << 20;
+
 /*
  * Get a range of minor numbers to work with, asking for a dynamic
  * major unless directed otherwise at load time.
@@ -630,6 +903,7 @@ static int __init scullv_init_module(void)
     /* Initialize each device */
     for (i = 0; i < scullv_devs; i++) {
         scullv_devices[i].order = scullv_order;
+        scullv_devices[i].flat = scullv_flat;
         scullv_devices[i].qset = scullv_qset;
         sema_init(&scullv_devices[i].sem, 1);   // semaphore value is one
         scullv_setup_cdev(&scullv_devices[i], i);
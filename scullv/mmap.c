@@ -0,0 +1,114 @@
+/*  -*- C -*-
+ * mmap.c -- memory mapping for the scullv char module
+ *
+ * Copyright (C) 2001 Alessandro Rubini and Jonathan Corbet
+ * Copyright (C) 2001 O'Reilly & Associates
+ *
+ * The source code in this file can be freely used, adapted,
+ * and redistributed in source or binary form, so long as an
+ * acknowledgment appears in derived source files.  The citation
+ * should list that the code comes from the book "Linux Device
+ * Drivers" by Alessandro Rubini and Jonathan Corbet, published
+ * by O'Reilly & Associates.   No warranty is attached;
+ * we cannot take responsibility for errors or fitness for use.
+ *
+ * $Id: _mmap.c.in,v 1.13 2004/10/18 18:07:36 corbet Exp $
+ */
+
+#include <linux/module.h>
+
+#include <linux/mm.h>		/* everything */
+#include <linux/errno.h>	/* error codes */
+#include <linux/semaphore.h>
+#include <asm/pgtable.h>
+
+#include "scull.h"		/* local definitions */
+
+
+/*
+ * open and close: just keep track of how many times the device is
+ * mapped, to avoid releasing it.
+ */
+
+void scullv_vma_open(struct vm_area_struct *vma)
+{
+	struct scullv_dev *dev = vma->vm_private_data;
+
+	dev->vmas++;
+}
+
+void scullv_vma_close(struct vm_area_struct *vma)
+{
+	struct scullv_dev *dev = vma->vm_private_data;
+
+	dev->vmas--;
+}
+
+/*
+ * The nopage method: retrieve the page required from the scullv
+ * device and return it to the user, with its count incremented as
+ * it is decremented at page unmap. A quantum is an array of order-0
+ * pages, so there is no vmalloc_to_page walk: the page is right
+ * there in the array, and each page has a count of its own.
+ */
+vm_fault_t scullv_vma_nopage(struct vm_fault *vmf)
+{
+	unsigned long offset;
+	struct scullv_dev *ptr, *dev = vmf->vma->vm_private_data;
+	struct scullv_quantum *q = NULL; /* default to "missing" */
+	struct page *page;
+	int npages = 1 << dev->order; /* pages per quantum */
+	vm_fault_t ret = VM_FAULT_SIGBUS;
+
+	if (down_killable(&dev->sem))
+		return VM_FAULT_SIGBUS; /* NOPAGE would loop a uaccess fault */
+	offset = (vmf->address - vmf->vma->vm_start) + (vmf->vma->vm_pgoff << PAGE_SHIFT);
+	if (offset >= dev->size) goto out; /* out of range */
+
+	/*
+	 * Now retrieve the scullv device from the list, then the quantum.
+	 * If the device has holes, the process receives a SIGBUS when
+	 * accessing the hole.
+	 */
+	offset >>= PAGE_SHIFT; /* offset is a number of pages */
+	if (dev->flat) { /* no list to walk, the pages are all in a row */
+		page = dev->fpages[offset];
+		goto got_it;
+	}
+	for (ptr = dev; ptr && offset >= dev->qset * npages;) {
+		ptr = ptr->next;
+		offset -= dev->qset * npages;
+	}
+	if (ptr && ptr->data) q = ptr->data[offset / npages];
+	if (!q) goto out; /* hole or end-of-file */
+	page = q->pages[offset % npages];
+
+ got_it:
+	/* got it, now increment the count */
+	get_page(page);
+	vmf->page = page;
+	ret = 0;
+ out:
+	up(&dev->sem);
+
+	return ret;
+}
+
+
+
+struct vm_operations_struct scullv_vm_ops = {
+	.open =     scullv_vma_open,
+	.close =    scullv_vma_close,
+	.fault =    scullv_vma_nopage,
+};
+
+
+int scullv_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	/* don't do anything here: "nopage" will set up page table entries */
+	vma->vm_ops = &scullv_vm_ops;
+	vma->vm_private_data = filp->private_data;
+	scullv_vma_open(vma);
+	return 0;
+}
+
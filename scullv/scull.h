@@ -58,6 +58,26 @@
 #define SCULLV_ORDER    4 /* one page at a time */
 #define SCULLV_QSET     500
 
+/*
+ * Flat mode keeps the whole device in one vmap, so it can't grow past
+ * the vmalloc area. The cap is in MB and can be raised at load time
+ * (scullv_flat_max) as far as the area allows; boot with vmalloc= to
+ * get a larger area on a 32-bit machine.
+ */
+#define SCULLV_FLAT_MAX 64
+
+/*
+ * A quantum is an array of order-0 pages, vmap'ed so that the kernel
+ * sees it contiguous. mmap uses the page array directly and the pages
+ * can be allocated in bulk; "scull_dev->data" points to these.
+ */
+struct scullv_quantum {
+	void *addr;               /* vmap'ed view of the pages */
+	unsigned int npages;      /* PAGE_SIZE << order, in pages */
+	int huge;                 /* vmalloc_huge owns the pages and addr */
+	struct page *pages[];     /* the backing store */
+};
+
 struct scullv_dev {
 	void **data;
 	struct scullv_dev *next;  /* next listitem */
@@ -65,6 +85,10 @@ struct scullv_dev {
 	int order;                /* the current allocation order */
 	int qset;                 /* the current array size */
 	size_t size;              /* 32-bit will suffice */
+	int flat;                 /* one contiguous region, no quanta */
+	struct page **fpages;     /* flat mode: the pages, in order */
+	unsigned long fnr;        /* ... how many are allocated */
+	void *faddr;              /* ... and their vmap'ed view */
 	struct semaphore sem;     /* Mutual exclusion */
 	struct cdev cdev;
 };
@@ -86,6 +110,9 @@ extern int scullv_major;     /* main.c */
 extern int scullv_devs;
 extern int scullv_order;
 extern int scullv_qset;
+extern int scullv_flat;
+extern int scullv_huge;
+extern int scullv_flat_max;
 
 
 /*
@@ -94,6 +121,8 @@ extern int scullv_qset;
 
 
 int     scullv_trim(struct scullv_dev *dev);
+struct scullv_quantum *scullv_alloc_quantum(int order);
+void    scullv_free_quantum(struct scullv_quantum *q);
 struct scullv_dev *scullv_follow(struct scullv_dev *dev, int n);
 
 /*
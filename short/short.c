@@ -25,6 +25,16 @@
 #include <linux/workqueue.h>
 #include <linux/poll.h>
 #include <linux/wait.h>
+#include <linux/ktime.h>
+#include <linux/percpu.h>
+#include <linux/atomic.h>
+#include <linux/timex.h>	/* get_cycles */
+#include <linux/proc_fs.h>
+#include <linux/seq_file.h>
+#include <linux/log2.h>
+#include <linux/hrtimer.h>
+#include <linux/mutex.h>
+#include <linux/debugfs.h>
 
 #include <asm/io.h>
 
@@ -63,13 +73,22 @@ module_param(tasklet, int, 0);
 static int share = 0;	/* select at load time whether install a shared irq */
 module_param(share, int, 0);
 
+static int binary = 0;	/* binary records in per-CPU rings instead of text */
+module_param(binary, int, 0);
+
+static int threaded = 0;	/* select whether a threaded irq is used */
+module_param(threaded, int, 0);
+
+static int poll_rate = 0;	/* irqs/s above which the line is polled, 0: never */
+module_param(poll_rate, int, 0);
+
+static int poll_us = 100;	/* period of the polling, when it's on */
+module_param(poll_us, int, 0);
+
 MODULE_AUTHOR ("Alessandro Rubini");
 MODULE_LICENSE("Dual BSD/GPL");
 
 
-unsigned long short_buffer = 0;
-unsigned long volatile short_head;
-volatile unsigned long short_tail;
 DECLARE_WAIT_QUEUE_HEAD(short_queue);
 
 /* Set up our tasklet if we're doing that. */
@@ -77,13 +96,294 @@ void short_do_tasklet(unsigned long);
 DECLARE_TASKLET(short_tasklet, short_do_tasklet, 0);
 
 /*
- * Atomicly increment an index into short_buffer
+ * Latency histograms, in debugfs (short/): how long the top half
+ * runs, how long events wait for the bottom half, and how old they
+ * are when read() hands them out (records consumed through mmap are
+ * not seen). Bucket b counts the values in [2^b, 2^(b+1)) ns. The
+ * counters are per CPU, so the top half only touches its own. Off
+ * until turned on, with "hist" at load time or short/enable.
+ */
+#define SHORT_HIST_BUCKETS 32	/* up to 4 s */
+
+enum { SHORT_HIST_TOP, SHORT_HIST_BH, SHORT_HIST_READ, SHORT_HIST_NR };
+
+struct short_hists {
+	unsigned long n[SHORT_HIST_NR][SHORT_HIST_BUCKETS];
+};
+
+static DEFINE_PER_CPU(struct short_hists, short_hists);
+
+static bool hist = false;
+module_param(hist, bool, 0);
+
+static inline void short_hist_add(int which, u64 ns)
+{
+	if (hist)
+		this_cpu_inc(short_hists.n[which][min(ilog2(ns | 1),
+				SHORT_HIST_BUCKETS - 1)]);
+}
+
+/* To time a top half: 0 when not counting */
+static inline u64 short_hist_start(void)
+{
+	return hist ? ktime_get_ns() : 0;
+}
+
+static inline void short_hist_since(int which, u64 t0)
+{
+	if (t0)
+		short_hist_add(which, ktime_get_ns() - t0);
+}
+
+/*
+ * Binary mode: each interrupt stores a fixed 16-byte record in a ring
+ * private to the CPU that took it, which costs a few stores instead of
+ * a formatted print, and no lock. The global sequence number lets
+ * readers merge the rings back in order. When a ring is full, the new
+ * record is dropped and counted: what was already there is never
+ * overwritten under a reader.
+ *
+ * The ring indexes live in a control page that user space can map
+ * read-write (offset 0), next to the rings themselves, mapped read
+ * only at offset ctl->rings_offset, one after the other in the order
+ * of the possible CPUs. A monitor then consumes records in place and
+ * moves the tail itself, and only calls poll() when all rings are
+ * empty; read() works on the same indexes, so use one or the other:
+ * read() fails with EBUSY while the control page is mapped. Readers
+ * are serialized by short_read_mutex.
+ * Indexes are free running 32-bit counters; the slot is the index
+ * modulo ring_entries. The kernel never trusts the tail to be sane.
+ */
+struct short_record {
+	u64 ns;		/* ktime_get_ns() */
+	u32 irq;
+	u32 seq;
+};
+
+#define SHORT_RING_ORDER 1	/* pages per CPU */
+#define SHORT_RING_SIZE  (PAGE_SIZE << SHORT_RING_ORDER)
+#define SHORT_RING_RECS  (SHORT_RING_SIZE / sizeof(struct short_record))
+
+#define SHORT_CTL_VERSION 1
+
+struct short_ring_head {	/* one cache line per ring */
+	u32 head;	/* records written, by the handler */
+	u32 tail;	/* records consumed, by the reader */
+	u32 lost;	/* dropped, the ring being full */
+	u32 pad[13];
+};
+
+struct short_ctl {
+	u32 version;		/* SHORT_CTL_VERSION */
+	u32 nr_rings;
+	u32 ring_entries;	/* records per ring, a power of two */
+	u32 rec_size;		/* sizeof(struct short_record) */
+	u32 rings_offset;	/* where to mmap the rings */
+	u32 pad[11];
+	struct short_ring_head rings[];
+};
+
+struct short_ring {
+	struct short_record *rec;
+	struct short_ring_head *h;	/* in the control page */
+};
+
+static DEFINE_PER_CPU(struct short_ring, short_rings);
+static DEFINE_MUTEX(short_read_mutex);
+static atomic_t short_ctl_maps = ATOMIC_INIT(0); /* of the control page */
+static struct short_ctl *short_ctl;
+static int short_ctl_order;
+static atomic_t short_seq = ATOMIC_INIT(0);
+
+static inline void short_bin_record(struct short_ring *ring, int irq)
+{
+	struct short_ring_head *h = ring->h;
+	u32 head = h->head;
+	struct short_record *rec;
+
+	if (head - READ_ONCE(h->tail) >= SHORT_RING_RECS) {
+		h->lost++;
+		return;
+	}
+	rec = ring->rec + (head & (SHORT_RING_RECS - 1));
+	rec->ns = ktime_get_ns();
+	rec->irq = irq;
+	rec->seq = atomic_inc_return(&short_seq);
+	smp_store_release(&h->head, head + 1); /* the record, then the index */
+}
+
+static int short_bin_pending(void)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct short_ring_head *h = per_cpu_ptr(&short_rings, cpu)->h;
+
+		if (READ_ONCE(h->head) != READ_ONCE(h->tail))
+			return 1;
+	}
+	return 0;
+}
+
+/* Wake readers, without touching the wait queue lock if there are none */
+static inline void short_wake(void)
+{
+	if (wq_has_sleeper(&short_queue))
+		wake_up_interruptible(&short_queue);
+}
+
+static int short_alloc_rings(void)
+{
+	int cpu, i = 0;
+
+	short_ctl_order = get_order(sizeof(struct short_ctl) +
+			num_possible_cpus() * sizeof(struct short_ring_head));
+	short_ctl = (void *)__get_free_pages(GFP_KERNEL | __GFP_ZERO,
+			short_ctl_order);
+	if (!short_ctl)
+		return -ENOMEM;
+	short_ctl->version = SHORT_CTL_VERSION;
+	short_ctl->nr_rings = num_possible_cpus();
+	short_ctl->ring_entries = SHORT_RING_RECS;
+	short_ctl->rec_size = sizeof(struct short_record);
+	short_ctl->rings_offset = PAGE_SIZE << short_ctl_order;
+
+	for_each_possible_cpu(cpu) {
+		struct short_ring *ring = per_cpu_ptr(&short_rings, cpu);
+
+		ring->h = short_ctl->rings + i++;
+		ring->rec = (void *)__get_free_pages(GFP_KERNEL | __GFP_ZERO,
+				SHORT_RING_ORDER);
+		if (!ring->rec)
+			return -ENOMEM;
+	}
+	return 0;
+}
+
+static void short_free_rings(void)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct short_ring *ring = per_cpu_ptr(&short_rings, cpu);
+
+		if (ring->rec)
+			free_pages((unsigned long)ring->rec, SHORT_RING_ORDER);
+		ring->rec = NULL;
+	}
+	if (short_ctl)
+		free_pages((unsigned long)short_ctl, short_ctl_order);
+	short_ctl = NULL;
+}
+
+/*
+ * Text mode: the buffer is made of 16-byte records, a page of them per
+ * CPU, each written only by the CPU it belongs to (with interrupts
+ * off), so that an interrupt taken anywhere does not pull a shared
+ * cache line over. Each record has the time it stands for as a key,
+ * and the reader merges the buffers on it. A full buffer drops the
+ * new record.
+ */
+#define SHORT_TEXT_REC  16
+#define SHORT_TEXT_RECS (PAGE_SIZE / SHORT_TEXT_REC)
+
+struct short_text_buf {
+	char *text;		/* a page of records */
+	u64 *key;		/* their wall clock time, in ns */
+	unsigned int head;	/* free running, like the rings */
+	unsigned int tail;	/* consumed: the slots before it are free */
+	unsigned int rtail;	/* read, maybe not consumed yet */
+};
+
+static DEFINE_PER_CPU(struct short_text_buf, short_text);
+static DEFINE_PER_CPU(unsigned long, short_text_lost);
+
+/* Store a record in this CPU's buffer. Interrupts must be off. */
+static inline void short_text_put(const char *rec, u64 key)
+{
+	struct short_text_buf *tb = this_cpu_ptr(&short_text);
+	unsigned int head = tb->head;
+
+	if (head - READ_ONCE(tb->tail) >= SHORT_TEXT_RECS) {
+		this_cpu_inc(short_text_lost);
+		return;
+	}
+	memcpy(tb->text + (head % SHORT_TEXT_RECS) * SHORT_TEXT_REC, rec,
+			SHORT_TEXT_REC);
+	tb->key[head % SHORT_TEXT_RECS] = key;
+	smp_store_release(&tb->head, head + 1);
+}
+
+static int short_text_pending(void)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct short_text_buf *tb = per_cpu_ptr(&short_text, cpu);
+
+		if (READ_ONCE(tb->head) != READ_ONCE(tb->tail))
+			return 1;
+	}
+	return 0;
+}
+
+static int short_alloc_text(void)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct short_text_buf *tb = per_cpu_ptr(&short_text, cpu);
+
+		tb->text = (char *)__get_free_page(GFP_KERNEL);
+		tb->key = kmalloc_array(SHORT_TEXT_RECS, sizeof(u64), GFP_KERNEL);
+		if (!tb->text || !tb->key)
+			return -ENOMEM;
+	}
+	return 0;
+}
+
+static void short_free_text(void)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct short_text_buf *tb = per_cpu_ptr(&short_text, cpu);
+
+		if (tb->text)
+			free_page((unsigned long)tb->text);
+		kfree(tb->key);
+		tb->text = NULL;
+		tb->key = NULL;
+	}
+}
+
+/*
+ * Text mode: a 16 byte record, "%08u.%06u\n", of the wall clock time.
  */
-static inline void short_incr_bp(volatile unsigned long *index, int delta)
+static inline int short_text_record(char *buf, u64 *key)
+{
+	struct timespec64 ts;
+
+	ktime_get_real_ts64(&ts);
+	*key = timespec64_to_ns(&ts);
+	return sprintf(buf, "%08u.%06u\n", (int)(ts.tv_sec % 100000000),
+			(int)(ts.tv_nsec / NSEC_PER_USEC));
+}
+
+/* What the handlers do, in either mode */
+static inline void short_stamp(int irq)
 {
-	unsigned long new = *index + delta;
-	barrier();  /* Don't optimize these two together */
-	*index = (new >= (short_buffer + PAGE_SIZE)) ? short_buffer : new;
+	char rec[SHORT_TEXT_REC + 1];
+	int written;
+	u64 key;
+
+	if (binary) {
+		short_bin_record(this_cpu_ptr(&short_rings), irq);
+		return;
+	}
+	written = short_text_record(rec, &key);
+	BUG_ON(written != SHORT_TEXT_REC);
+	short_text_put(rec, key);
 }
 
 
@@ -97,18 +397,50 @@ static inline void short_incr_bp(volatile unsigned long *index, int delta)
  * generates interrupts.  
  */
 
+/*
+ * Data moves through a bounce buffer of SHORT_CHUNK bytes, one per
+ * open file of the port nodes, instead of one of the size of the
+ * whole transfer per call. Reads and writes on the same file, from
+ * several threads or both ways on an O_RDWR file, take turns on it.
+ */
+#define SHORT_CHUNK PAGE_SIZE
+
+struct short_file {
+	struct mutex lock;	/* protects buf */
+	unsigned char *buf;	/* SHORT_CHUNK bytes */
+};
+
 int short_open (struct inode *inode, struct file *filp)
 {
 	extern struct file_operations short_i_fops;
+	struct short_file *sf;
 
-	if (iminor (inode) & 0x80)
+	if (iminor (inode) & 0x80) {
 		filp->f_op = &short_i_fops; /* the interrupt-driven node */
+		return 0;
+	}
+	sf = kmalloc(sizeof(*sf), GFP_KERNEL);
+	if (!sf)
+		return -ENOMEM;
+	sf->buf = kmalloc(SHORT_CHUNK, GFP_KERNEL);
+	if (!sf->buf) {
+		kfree(sf);
+		return -ENOMEM;
+	}
+	mutex_init(&sf->lock);
+	filp->private_data = sf;
 	return 0;
 }
 
 
 int short_release (struct inode *inode, struct file *filp)
 {
+	struct short_file *sf = filp->private_data;
+
+	if (sf) { /* NULL for the interrupt node */
+		kfree(sf->buf);
+		kfree(sf);
+	}
 	return 0;
 }
 
@@ -117,56 +449,95 @@ int short_release (struct inode *inode, struct file *filp)
 
 enum short_modes {SHORT_DEFAULT=0, SHORT_PAUSE, SHORT_STRING, SHORT_MEMORY};
 
-ssize_t do_short_read (struct inode *inode, struct file *filp, char __user *buf,
-		size_t count, loff_t *f_pos)
+/*
+ * One chunk at a time. The string and memory modes move the chunk
+ * with a single string instruction (insb, ioread8_rep); the default
+ * one still goes a byte at a time, as the device may want, but the
+ * accesses to a port are ordered anyway, so one barrier at the end
+ * of the chunk is enough. The pausing mode is left alone: it is
+ * slow on purpose.
+ */
+static void short_read_chunk(int mode, unsigned long port,
+		void __iomem *address, unsigned char *ptr, size_t count)
 {
-	int retval = count, minor = iminor (inode);
-	unsigned long port = short_base + (minor&0x0f);
-	void *address = (void *) short_base + (minor&0x0f);
-	int mode = (minor&0x70) >> 4;
-	unsigned char *kbuf = kmalloc(count, GFP_KERNEL), *ptr;
-    
-	if (!kbuf)
-		return -ENOMEM;
-	ptr = kbuf;
-
-	if (use_mem)
-		mode = SHORT_MEMORY;
-	
 	switch(mode) {
 	    case SHORT_STRING:
 		insb(port, ptr, count);
-		rmb();
 		break;
 
 	    case SHORT_DEFAULT:
-		while (count--) {
+		while (count--)
 			*(ptr++) = inb(port);
-			rmb();
-		}
 		break;
 
 	    case SHORT_MEMORY:
-		while (count--) {
-			*ptr++ = ioread8(address);
-			rmb();
-		}
+		ioread8_rep(address, ptr, count);
 		break;
+
 	    case SHORT_PAUSE:
 		while (count--) {
 			*(ptr++) = inb_p(port);
 			rmb();
 		}
 		break;
+	}
+	rmb();
+}
+
+static void short_write_chunk(int mode, unsigned long port,
+		void __iomem *address, unsigned char *ptr, size_t count)
+{
+	switch(mode) {
+	case SHORT_PAUSE:
+		while (count--) {
+			outb_p(*(ptr++), port);
+			wmb();
+		}
+		break;
+
+	case SHORT_STRING:
+		outsb(port, ptr, count);
+		break;
 
-	    default: /* no more modes defined by now */
-		retval = -EINVAL;
+	case SHORT_DEFAULT:
+		while (count--)
+			outb(*(ptr++), port);
+		break;
+
+	case SHORT_MEMORY:
+		iowrite8_rep(address, ptr, count);
 		break;
 	}
-	if ((retval > 0) && copy_to_user(buf, kbuf, retval))
-		retval = -EFAULT;
-	kfree(kbuf);
-	return retval;
+	wmb();
+}
+
+ssize_t do_short_read (struct inode *inode, struct file *filp, char __user *buf,
+		size_t count, loff_t *f_pos)
+{
+	int minor = iminor (inode);
+	unsigned long port = short_base + (minor&0x0f);
+	void __iomem *address = (void __iomem *) short_base + (minor&0x0f);
+	int mode = (minor&0x70) >> 4;
+	struct short_file *sf = filp->private_data;
+	unsigned char *kbuf = sf->buf;
+	size_t done = 0, chunk;
+
+	if (use_mem)
+		mode = SHORT_MEMORY;
+	if (mode > SHORT_MEMORY) /* no more modes defined by now */
+		return -EINVAL;
+
+	if (mutex_lock_interruptible(&sf->lock))
+		return -ERESTARTSYS;
+	while (done < count) {
+		chunk = min_t(size_t, count - done, SHORT_CHUNK);
+		short_read_chunk(mode, port, address, kbuf, chunk);
+		if (copy_to_user(buf + done, kbuf, chunk))
+			break;
+		done += chunk;
+	}
+	mutex_unlock(&sf->lock);
+	return done || !count ? done : -EFAULT;
 }
 
 
@@ -183,54 +554,30 @@ ssize_t short_read(struct file *filp, char __user *buf, size_t count, loff_t *f_
 ssize_t do_short_write (struct inode *inode, struct file *filp, const char __user *buf,
 		size_t count, loff_t *f_pos)
 {
-	int retval = count, minor = iminor(inode);
+	int minor = iminor(inode);
 	unsigned long port = short_base + (minor&0x0f);
-	void *address = (void *) short_base + (minor&0x0f);
+	void __iomem *address = (void __iomem *) short_base + (minor&0x0f);
 	int mode = (minor&0x70) >> 4;
-	unsigned char *kbuf = kmalloc(count, GFP_KERNEL), *ptr;
-
-	if (!kbuf)
-		return -ENOMEM;
-	if (copy_from_user(kbuf, buf, count))
-		return -EFAULT;
-	ptr = kbuf;
+	struct short_file *sf = filp->private_data;
+	unsigned char *kbuf = sf->buf;
+	size_t done = 0, chunk;
 
 	if (use_mem)
 		mode = SHORT_MEMORY;
-
-	switch(mode) {
-	case SHORT_PAUSE:
-		while (count--) {
-			outb_p(*(ptr++), port);
-			wmb();
-		}
-		break;
-
-	case SHORT_STRING:
-		outsb(port, ptr, count);
-		wmb();
-		break;
-
-	case SHORT_DEFAULT:
-		while (count--) {
-			outb(*(ptr++), port);
-			wmb();
-		}
-		break;
-
-	case SHORT_MEMORY:
-		while (count--) {
-			iowrite8(*ptr++, address);
-			wmb();
-		}
-		break;
-
-	default: /* no more modes defined by now */
-		retval = -EINVAL;
-		break;
+	if (mode > SHORT_MEMORY) /* no more modes defined by now */
+		return -EINVAL;
+
+	if (mutex_lock_interruptible(&sf->lock))
+		return -ERESTARTSYS;
+	while (done < count) {
+		chunk = min_t(size_t, count - done, SHORT_CHUNK);
+		if (copy_from_user(kbuf, buf + done, chunk))
+			break;
+		short_write_chunk(mode, port, address, kbuf, chunk);
+		done += chunk;
 	}
-	kfree(kbuf);
-	return retval;
+	mutex_unlock(&sf->lock);
+	return done || !count ? done : -EFAULT;
 }
 
 
@@ -264,29 +611,182 @@ struct file_operations short_fops = {
 
 /* then,  the interrupt-related device */
 
-ssize_t short_i_read (struct file *filp, char __user *buf, size_t count, loff_t *f_pos)
+/* Take short_read_mutex for a reader: nonzero if it couldn't be had */
+static int short_read_lock(struct file *filp)
 {
-	int count0;
-	DEFINE_WAIT(wait);
+	if (filp->f_flags & O_NONBLOCK)
+		return !mutex_trylock(&short_read_mutex);
+	return mutex_lock_interruptible(&short_read_mutex);
+}
 
-	while (short_head == short_tail) {
+/*
+ * Binary read: whole records, from each CPU's ring in turn. The
+ * records of a ring are in order; use seq to merge the rings.
+ */
+static ssize_t short_bin_read(struct file *filp, char __user *buf, size_t count)
+{
+	size_t done = 0, n, i;
+	u64 now;
+	int cpu;
+
+	count -= count % sizeof(struct short_record);
+	if (!count)
+		return -EINVAL;
+	if (short_read_lock(filp))
+		return filp->f_flags & O_NONBLOCK ? -EAGAIN : -ERESTARTSYS;
+	if (atomic_read(&short_ctl_maps)) {
+		mutex_unlock(&short_read_mutex);
+		return -EBUSY; /* a mapper owns the tails */
+	}
+	while (!short_bin_pending()) {
+		mutex_unlock(&short_read_mutex);
+		if (filp->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+		if (wait_event_interruptible(short_queue, short_bin_pending()))
+			return -ERESTARTSYS;
+		if (short_read_lock(filp))
+			return -ERESTARTSYS;
+		if (atomic_read(&short_ctl_maps)) {
+			mutex_unlock(&short_read_mutex);
+			return -EBUSY;
+		}
+	}
+	now = ktime_get_ns();
+
+	for_each_possible_cpu(cpu) {
+		struct short_ring *ring = per_cpu_ptr(&short_rings, cpu);
+		struct short_ring_head *h = ring->h;
+		u32 tail = READ_ONCE(h->tail);
+		u32 head = smp_load_acquire(&h->head);
+
+		if (head - tail > SHORT_RING_RECS) /* a mapper broke it */
+			tail = head;
+		while (tail != head && done < count) {
+			u32 idx = tail & (SHORT_RING_RECS - 1);
+
+			n = min3(head - tail, SHORT_RING_RECS - idx,
+					(count - done) / sizeof(struct short_record));
+			if (copy_to_user(buf + done, ring->rec + idx,
+					n * sizeof(struct short_record))) {
+				smp_store_release(&h->tail, tail);
+				mutex_unlock(&short_read_mutex);
+				return done ? done : -EFAULT;
+			}
+			for (i = 0; hist && i < n; i++)
+				if (now > ring->rec[idx + i].ns)
+					short_hist_add(SHORT_HIST_READ,
+						now - ring->rec[idx + i].ns);
+			done += n * sizeof(struct short_record);
+			tail += n;
+		}
+		smp_store_release(&h->tail, tail); /* the slots are free again */
+	}
+	mutex_unlock(&short_read_mutex);
+	return done;
+}
+
+/*
+ * Text read: whole records, the oldest first over all the CPU
+ * buffers. They go out through a small buffer on the stack. The merge
+ * moves the reader's own cursor (rtail) only; the tails the handlers
+ * look at follow once the records have reached user space, so a fault
+ * loses nothing. Readers are serialized by short_read_mutex.
+ */
+#define SHORT_TEXT_BATCH 16	/* records in the stack buffer */
+
+/* Hand a batch to user space, then free its slots, or take it back */
+static int short_text_flush(char __user *buf, const char *out,
+		struct short_text_buf **from, size_t fill)
+{
+	int i, n = fill / SHORT_TEXT_REC;
+	int err = copy_to_user(buf, out, fill) ? -EFAULT : 0;
+
+	for (i = 0; i < n; i++) {
+		if (err)
+			from[i]->rtail = from[i]->tail;
+		else
+			smp_store_release(&from[i]->tail, from[i]->rtail);
+	}
+	return err;
+}
+
+static ssize_t short_text_read(struct file *filp, char __user *buf, size_t count)
+{
+	char out[SHORT_TEXT_BATCH * SHORT_TEXT_REC];
+	struct short_text_buf *from[SHORT_TEXT_BATCH];
+	struct short_text_buf *tb, *oldest;
+	size_t done = 0, fill = 0;
+	unsigned int tail;
+	u64 key, oldest_key = 0, now;
+	DEFINE_WAIT(wait);
+	int cpu, err = 0;
+
+	count -= count % SHORT_TEXT_REC;
+	if (!count)
+		return -EINVAL;
+	if (short_read_lock(filp))
+		return filp->f_flags & O_NONBLOCK ? -EAGAIN : -ERESTARTSYS;
+	while (!short_text_pending()) {
+		mutex_unlock(&short_read_mutex);
+		if (filp->f_flags & O_NONBLOCK)
+			return -EAGAIN;
 		prepare_to_wait(&short_queue, &wait, TASK_INTERRUPTIBLE);
-		if (short_head == short_tail)
+		if (!short_text_pending())
 			schedule();
 		finish_wait(&short_queue, &wait);
 		if (signal_pending (current))  /* a signal arrived */
 			return -ERESTARTSYS; /* tell the fs layer to handle it */
-	} 
-	/* count0 is the number of readable data bytes */
-	count0 = short_head - short_tail;
-	if (count0 < 0) /* wrapped */
-		count0 = short_buffer + PAGE_SIZE - short_tail;
-	if (count0 < count) count = count0;
-
-	if (copy_to_user(buf, (char *)short_tail, count))
-		return -EFAULT;
-	short_incr_bp (&short_tail, count);
-	return count;
+		if (short_read_lock(filp))
+			return -ERESTARTSYS;
+	}
+	now = ktime_get_real_ns();
+
+	while (done + fill < count) {
+		oldest = NULL;
+		for_each_possible_cpu(cpu) {
+			tb = per_cpu_ptr(&short_text, cpu);
+			tail = tb->rtail;
+			if (tail == smp_load_acquire(&tb->head))
+				continue;
+			key = tb->key[tail % SHORT_TEXT_RECS];
+			if (!oldest || key < oldest_key) {
+				oldest = tb;
+				oldest_key = key;
+			}
+		}
+		if (!oldest)
+			break; /* all empty */
+		tail = oldest->rtail;
+		memcpy(out + fill, oldest->text + (tail % SHORT_TEXT_RECS) *
+				SHORT_TEXT_REC, SHORT_TEXT_REC);
+		oldest->rtail = tail + 1;
+		from[fill / SHORT_TEXT_REC] = oldest;
+		if (now > oldest_key)
+			short_hist_add(SHORT_HIST_READ, now - oldest_key);
+		fill += SHORT_TEXT_REC;
+		if (fill == sizeof(out)) {
+			err = short_text_flush(buf + done, out, from, fill);
+			if (err)
+				goto out;
+			done += fill;
+			fill = 0;
+		}
+	}
+	if (fill) {
+		err = short_text_flush(buf + done, out, from, fill);
+		if (!err)
+			done += fill;
+	}
+  out:
+	mutex_unlock(&short_read_mutex);
+	return done ? done : err;
+}
+
+ssize_t short_i_read (struct file *filp, char __user *buf, size_t count, loff_t *f_pos)
+{
+	if (binary)
+		return short_bin_read(filp, buf, count);
+	return short_text_read(filp, buf, count);
 }
 
 ssize_t short_i_write (struct file *filp, const char __user *buf, size_t count,
@@ -311,101 +811,317 @@ ssize_t short_i_write (struct file *filp, const char __user *buf, size_t count,
 
 
 
+unsigned int short_i_poll(struct file *filp, poll_table *wait)
+{
+	int ready;
+
+	poll_wait(filp, &short_queue, wait);
+	ready = binary ? short_bin_pending() : short_text_pending();
+	return ready ? POLLIN | POLLRDNORM : 0;
+}
+
+/*
+ * A mapping of the control page makes its owner the consumer: read()
+ * stays out of the rings until the last one goes. Not under
+ * short_read_mutex: these run with mmap_sem held, which a reader may
+ * need for copy_to_user while holding the mutex.
+ */
+static void short_ctl_vma_open(struct vm_area_struct *vma)
+{
+	atomic_inc(&short_ctl_maps);
+}
+
+static void short_ctl_vma_close(struct vm_area_struct *vma)
+{
+	atomic_dec(&short_ctl_maps);
+}
+
+static const struct vm_operations_struct short_ctl_vm_ops = {
+	.open  = short_ctl_vma_open,
+	.close = short_ctl_vma_close,
+};
+
+/*
+ * Map the control page (offset 0, read-write, as the consumer moves
+ * the tails) or the binary rings (offset rings_offset, read only).
+ */
+static int short_i_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	unsigned long len = vma->vm_end - vma->vm_start, off = 0;
+	unsigned long ctl_pages = 1UL << short_ctl_order;
+	int cpu, ret;
+
+	if (!binary)
+		return -ENODEV;
+	if (vma->vm_pgoff == 0) {
+		if (len > PAGE_SIZE << short_ctl_order)
+			return -EINVAL;
+		ret = remap_pfn_range(vma, vma->vm_start,
+				virt_to_phys(short_ctl) >> PAGE_SHIFT,
+				len, vma->vm_page_prot);
+		if (ret)
+			return ret;
+		vma->vm_ops = &short_ctl_vm_ops;
+		short_ctl_vma_open(vma);
+		return 0;
+	}
+	if (vma->vm_flags & VM_WRITE)
+		return -EACCES;
+	if (vma->vm_pgoff != ctl_pages ||
+			len > num_possible_cpus() * SHORT_RING_SIZE)
+		return -EINVAL;
+	vma->vm_flags &= ~VM_MAYWRITE;
+
+	for_each_possible_cpu(cpu) {
+		struct short_ring *ring = per_cpu_ptr(&short_rings, cpu);
+
+		if (off >= len)
+			break;
+		ret = remap_pfn_range(vma, vma->vm_start + off,
+				virt_to_phys(ring->rec) >> PAGE_SHIFT,
+				min(SHORT_RING_SIZE, len - off), vma->vm_page_prot);
+		if (ret)
+			return ret;
+		off += SHORT_RING_SIZE;
+	}
+	return 0;
+}
+
 struct file_operations short_i_fops = {
 	.owner	 = THIS_MODULE,
 	.read	 = short_i_read,
 	.write	 = short_i_write,
+	.poll	 = short_i_poll,
+	.mmap	 = short_i_mmap,
 	.open	 = short_open,
 	.release = short_release,
 };
 
-irqreturn_t short_interrupt(int irq, void *dev_id)
+/*
+ * What /proc/shortstat reports. Written with no locking, by the
+ * handlers: they are statistics.
+ */
+static struct {
+	unsigned long irqs;		/* top halves */
+	unsigned long bh_runs;		/* bottom halves with work to do */
+	unsigned long tv_lost;		/* the tv ring was full */
+	u64 bh_lat_ns;			/* top half to bottom half, total */
+	u64 bh_lat_max_ns;
+	unsigned long poll_on;		/* switches to polling */
+	unsigned long polled;		/* events found by polling */
+} short_stats;
+
+/*
+ * Adaptive mode, much like NAPI: when interrupts come in faster than
+ * poll_rate per second, the line is disabled and a timer looks at the
+ * port every poll_us instead. An event is bit 7 of the data latch
+ * being set, as the shared handler sees it, and it is cleared the
+ * same way. A burst then costs one timer tick per poll_us and one
+ * reader wakeup per tick at most, whatever the interrupt rate; it
+ * also coalesces the edges that come in between two ticks, which is
+ * the price to pay. Below half the rate the interrupt comes back.
+ * Rates are counted over SHORT_RATE_WINDOW.
+ */
+#define SHORT_RATE_WINDOW max(HZ / 10, 1)
+
+static struct hrtimer short_poll_timer;
+static int short_polling;
+static unsigned long short_rate_start;	/* jiffies */
+static unsigned int short_rate_count;	/* events since then */
+
+static inline unsigned int short_rate_limit(void)
 {
-	struct timeval tv;
-	int written;
+	return max(poll_rate * SHORT_RATE_WINDOW / HZ, 1);
+}
 
-	do_gettimeofday(&tv);
+/* Called by the top halves, with every interrupt */
+static inline void short_adapt(int irq)
+{
+	if (!poll_rate)
+		return;
+	if (time_after(jiffies, short_rate_start + SHORT_RATE_WINDOW)) {
+		short_rate_start = jiffies;
+		short_rate_count = 0;
+	}
+	if (++short_rate_count <= short_rate_limit() || short_polling)
+		return;
+	disable_irq_nosync(irq);
+	short_polling = 1;
+	short_stats.poll_on++;
+	short_rate_start = jiffies;
+	short_rate_count = 0;
+	hrtimer_start(&short_poll_timer, ns_to_ktime((u64)poll_us * NSEC_PER_USEC),
+			HRTIMER_MODE_REL);
+}
 
-	    /* Write a 16 byte record. Assume PAGE_SIZE is a multiple of 16 */
-	written = sprintf((char *)short_head,"%08u.%06u\n",
-			(int)(tv.tv_sec % 100000000), (int)(tv.tv_usec));
-	BUG_ON(written != 16);
-	short_incr_bp(&short_head, written);
-	wake_up_interruptible(&short_queue); /* awake any reading process */
+static enum hrtimer_restart short_poll_tick(struct hrtimer *timer)
+{
+	int value = inb(short_base);
+
+	if (value & 0x80) {
+		outb(value & 0x7F, short_base); /* clear it */
+		short_stamp(short_irq);
+		short_stats.polled++;
+		short_rate_count++;
+		short_wake();
+	}
+	if (time_after(jiffies, short_rate_start + SHORT_RATE_WINDOW)) {
+		if (short_rate_count < short_rate_limit() / 2) {
+			short_polling = 0; /* quiet again */
+			enable_irq(short_irq);
+			return HRTIMER_NORESTART;
+		}
+		short_rate_start = jiffies;
+		short_rate_count = 0;
+	}
+	hrtimer_forward_now(timer, ns_to_ktime((u64)poll_us * NSEC_PER_USEC));
+	return HRTIMER_RESTART;
+}
+
+irqreturn_t short_interrupt(int irq, void *dev_id)
+{
+	u64 t0 = short_hist_start();
+
+	short_stats.irqs++;
+	short_adapt(irq);
+	short_stamp(irq);
+	short_wake(); /* awake any reading process */
+	short_hist_since(SHORT_HIST_TOP, t0);
 	return IRQ_HANDLED;
 }
 
 /*
- * The following two functions are equivalent to the previous one,
- * but split in top and bottom half. First, a few needed variables
+ * The following functions are equivalent to the previous one, but
+ * split in top and bottom half, the latter being a tasklet, a work
+ * queue item or an interrupt thread. The top half only timestamps the
+ * interrupt in the tv ring (or the binary ring) and counts it; the
+ * bottom half drains all that is pending, however many interrupts
+ * that is, and prints it out. First, a few needed variables.
  */
 
-#define NR_TIMEVAL 512 /* length of the array of time values */
+static int tvsize = 512;	/* length of the array of time values */
+module_param(tvsize, int, 0);
 
-struct timeval tv_data[NR_TIMEVAL]; /* too lazy to allocate it */
-volatile struct timeval *tv_head=tv_data;
-volatile struct timeval *tv_tail=tv_data;
+static u64 *tv_data;		/* wall clock ns; allocated in short_init */
+static unsigned int tv_mask;	/* tvsize, rounded up to a power of two, - 1 */
+static unsigned int tv_head, tv_tail; /* free running */
 
 static struct work_struct short_wq;
 
-
-int short_wq_count = 0;
+int short_wq_count = 0;		/* interrupts since the last bottom half */
+static u64 short_bh_stamp;	/* when the first of them came in */
 
 /*
- * Increment a circular buffer pointer in a way that nobody sees
- * an intermediate value.
+ * Store a time value, unless the ring is full: the old ones have not
+ * been printed yet, so the new one is dropped and counted.
  */
-static inline void short_incr_tv(volatile struct timeval **tvp)
+static inline void short_tv_put(void)
 {
-	if (*tvp == (tv_data + NR_TIMEVAL - 1))
-		*tvp = tv_data;	 /* Wrap */
-	else
-		(*tvp)++;
-}
+	unsigned int head = tv_head;
 
+	if (head - READ_ONCE(tv_tail) > tv_mask) {
+		short_stats.tv_lost++;
+		return;
+	}
+	tv_data[head & tv_mask] = ktime_get_real_ns();
+	smp_store_release(&tv_head, head + 1);
+}
 
+/* The common part of the split top halves */
+static inline void short_top_half(int irq)
+{
+	if (binary)
+		short_bin_record(this_cpu_ptr(&short_rings), irq);
+	else
+		short_tv_put();
+	if (short_wq_count++ == 0)
+		short_bh_stamp = ktime_get_ns();
+	short_stats.irqs++;
+	short_adapt(irq);
+}
 
-void short_do_tasklet (unsigned long unused)
+static void short_bottom_half(void)
 {
-	int savecount = short_wq_count, written;
-	short_wq_count = 0; /* we have already been removed from the queue */
+	u64 lat = ktime_get_ns() - READ_ONCE(short_bh_stamp);
+	char rec[24];
+	unsigned long flags;
+	unsigned int tail, head;
+	int savecount;
+	u32 usec;
+	u64 sec;
+
+	/* we have already been removed from the queue */
+	savecount = xchg(&short_wq_count, 0);
+	if (!savecount)
+		return; /* a thread woken twice: the first run got it all */
+	short_stats.bh_runs++;
+	short_stats.bh_lat_ns += lat;
+	short_hist_add(SHORT_HIST_BH, lat);
+	if (lat > short_stats.bh_lat_max_ns)
+		short_stats.bh_lat_max_ns = lat;
+
+	if (binary) { /* the top half has done it all */
+		wake_up_interruptible(&short_queue);
+		return;
+	}
 	/*
 	 * The bottom half reads the tv array, filled by the top half,
 	 * and prints it to the circular text buffer, which is then consumed
 	 * by reading processes
 	 */
 
-	/* First write the number of interrupts that occurred before this bh */
-	written = sprintf((char *)short_head,"bh after %6i\n",savecount);
-	short_incr_bp(&short_head, written);
+	/*
+	 * First write the number of interrupts that occurred before this
+	 * bh; it sorts with the first of them. The buffer is this CPU's
+	 * and the top half may come in on it: keep it out while writing.
+	 */
+	tail = tv_tail;
+	head = smp_load_acquire(&tv_head);
+	sprintf(rec, "bh after %6i\n", savecount);
+	local_irq_save(flags);
+	short_text_put(rec, tail != head ? tv_data[tail & tv_mask] :
+			ktime_get_real_ns());
+	local_irq_restore(flags);
 
 	/*
 	 * Then, write the time values. Write exactly 16 bytes at a time,
 	 * so it aligns with PAGE_SIZE
 	 */
-
-	do {
-		written = sprintf((char *)short_head,"%08u.%06u\n",
-				(int)(tv_tail->tv_sec % 100000000),
-				(int)(tv_tail->tv_usec));
-		short_incr_bp(&short_head, written);
-		short_incr_tv(&tv_tail);
-	} while (tv_tail != tv_head);
+	for (; tail != head; tail++) {
+		sec = div_u64_rem(tv_data[tail & tv_mask], NSEC_PER_SEC, &usec);
+		usec /= NSEC_PER_USEC;
+		sprintf(rec, "%08u.%06u\n", (int)(do_div(sec, 100000000)),
+				(int)usec);
+		local_irq_save(flags);
+		short_text_put(rec, tv_data[tail & tv_mask]);
+		local_irq_restore(flags);
+	}
+	smp_store_release(&tv_tail, tail);
 
 	wake_up_interruptible(&short_queue); /* awake any reading process */
 }
 
+void short_do_tasklet (unsigned long unused)
+{
+	short_bottom_half();
+}
+
+static void short_do_work(struct work_struct *work)
+{
+	short_bottom_half();
+}
+
 
-irqreturn_t short_wq_interrupt(int irq, void *dev_id, struct pt_regs *regs)
+irqreturn_t short_wq_interrupt(int irq, void *dev_id)
 {
+	u64 t0 = short_hist_start();
+
 	/* Grab the current time information. */
-	do_gettimeofday((struct timeval *) tv_head);
-	short_incr_tv(&tv_head);
+	short_top_half(irq);
 
 	/* Queue the bh. Don't worry about multiple enqueueing */
 	schedule_work(&short_wq);
-
-	short_wq_count++; /* record that an interrupt arrived */
+	short_hist_since(SHORT_HIST_TOP, t0);
 	return IRQ_HANDLED;
 }
 
@@ -414,22 +1130,43 @@ irqreturn_t short_wq_interrupt(int irq, void *dev_id, struct pt_regs *regs)
  * Tasklet top half
  */
 
-irqreturn_t short_tl_interrupt(int irq, void *dev_id, struct pt_regs *regs)
+irqreturn_t short_tl_interrupt(int irq, void *dev_id)
 {
-	do_gettimeofday((struct timeval *) tv_head); /* cast to stop 'volatile' warning */
-	short_incr_tv(&tv_head);
+	u64 t0 = short_hist_start();
+
+	short_top_half(irq);
 	tasklet_schedule(&short_tasklet);
-	short_wq_count++; /* record that an interrupt arrived */
+	short_hist_since(SHORT_HIST_TOP, t0);
 	return IRQ_HANDLED;
 }
 
 
+/*
+ * Threaded top half and the interrupt thread. The line stays enabled
+ * while the thread runs, and interrupts coming in meanwhile only make
+ * it go around once more: a burst is drained in a single pass.
+ */
+
+irqreturn_t short_th_interrupt(int irq, void *dev_id)
+{
+	u64 t0 = short_hist_start();
+
+	short_top_half(irq);
+	short_hist_since(SHORT_HIST_TOP, t0);
+	return IRQ_WAKE_THREAD;
+}
+
+static irqreturn_t short_thread_fn(int irq, void *dev_id)
+{
+	short_bottom_half();
+	return IRQ_HANDLED;
+}
 
 
 irqreturn_t short_sh_interrupt(int irq, void *dev_id)
 {
-	int value, written;
-	struct timeval tv;
+	u64 t0 = short_hist_start();
+	int value;
 
 	/* If it wasn't short, return immediately */
 	value = inb(short_base);
@@ -441,11 +1178,10 @@ irqreturn_t short_sh_interrupt(int irq, void *dev_id)
 
 	/* the rest is unchanged */
 
-	do_gettimeofday(&tv);
-	written = sprintf((char *)short_head,"%08u.%06u\n",
-			(int)(tv.tv_sec % 100000000), (int)(tv.tv_usec));
-	short_incr_bp(&short_head, written);
-	wake_up_interruptible(&short_queue); /* awake any reading process */
+	short_stats.irqs++;
+	short_stamp(irq);
+	short_wake(); /* awake any reading process */
+	short_hist_since(SHORT_HIST_TOP, t0);
 	return IRQ_HANDLED;
 }
 
@@ -529,6 +1265,188 @@ void short_selfprobe(void)
 
 
 
+/*
+ * /proc/shortstat: how the interrupts were handled. Compare the
+ * modes by loading the module with each in turn (see short_bhbench).
+ */
+static int short_stat_show(struct seq_file *s, void *v)
+{
+	unsigned long lost = 0, text_lost = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		text_lost += per_cpu(short_text_lost, cpu);
+	if (short_ctl)
+		for_each_possible_cpu(cpu)
+			lost += per_cpu_ptr(&short_rings, cpu)->h->lost;
+	seq_printf(s, "mode: %s\n", threaded ? "threaded" : tasklet ? "tasklet" :
+			wq ? "workqueue" : "top half only");
+	seq_printf(s, "irqs: %lu\n", short_stats.irqs);
+	seq_printf(s, "bottom halves: %lu\n", short_stats.bh_runs);
+	seq_printf(s, "irqs per bottom half: %lu\n", short_stats.bh_runs ?
+			short_stats.irqs / short_stats.bh_runs : 0);
+	seq_printf(s, "bh latency: avg %llu ns, max %llu ns\n",
+			short_stats.bh_runs ? div64_u64(short_stats.bh_lat_ns,
+				short_stats.bh_runs) : 0,
+			short_stats.bh_lat_max_ns);
+	seq_printf(s, "tv ring: %u entries, %lu lost\n", tv_mask + 1,
+			short_stats.tv_lost);
+	seq_printf(s, "text buffers: %lu lost\n", text_lost);
+	seq_printf(s, "binary rings: %lu lost\n", lost);
+	seq_printf(s, "polling: %s, switched on %lu times, %lu events polled\n",
+			short_polling ? "on" : "off", short_stats.poll_on,
+			short_stats.polled);
+	return 0;
+}
+
+static int short_stat_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, short_stat_show, NULL);
+}
+
+static struct file_operations short_stat_ops = {
+	.owner	 = THIS_MODULE,
+	.open	 = short_stat_open,
+	.read	 = seq_read,
+	.llseek	 = seq_lseek,
+	.release = single_release
+};
+
+/*
+ * The debugfs side of the histograms: one file each, summed over the
+ * CPUs, plus "enable" and "reset" (write anything).
+ */
+static struct dentry *short_debugfs;
+static const char *short_hist_names[SHORT_HIST_NR] = {
+	"tophalf_ns", "bh_delay_ns", "read_delay_ns",
+};
+
+static int short_hist_show(struct seq_file *s, void *v)
+{
+	int which = (long)s->private, cpu, b;
+	unsigned long count;
+
+	for (b = 0; b < SHORT_HIST_BUCKETS; b++) {
+		count = 0;
+		for_each_possible_cpu(cpu)
+			count += per_cpu_ptr(&short_hists, cpu)->n[which][b];
+		if (count)
+			seq_printf(s, "%10llu - %10llu: %lu\n", 1ULL << b,
+					(2ULL << b) - 1, count);
+	}
+	return 0;
+}
+
+static int short_hist_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, short_hist_show, inode->i_private);
+}
+
+static const struct file_operations short_hist_fops = {
+	.owner	 = THIS_MODULE,
+	.open	 = short_hist_open,
+	.read	 = seq_read,
+	.llseek	 = seq_lseek,
+	.release = single_release
+};
+
+static ssize_t short_hist_reset(struct file *file, const char __user *buf,
+		size_t count, loff_t *ppos)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		memset(per_cpu_ptr(&short_hists, cpu), 0,
+				sizeof(struct short_hists));
+	return count;
+}
+
+static const struct file_operations short_reset_fops = {
+	.owner	 = THIS_MODULE,
+	.write	 = short_hist_reset,
+};
+
+static void short_create_debugfs(void)
+{
+	long i;
+
+	short_debugfs = debugfs_create_dir("short", NULL);
+	if (IS_ERR_OR_NULL(short_debugfs))
+		return; /* no debugfs: no histograms to look at, that's all */
+	debugfs_create_bool("enable", 0644, short_debugfs, &hist);
+	debugfs_create_file("reset", 0200, short_debugfs, NULL,
+			&short_reset_fops);
+	for (i = 0; i < SHORT_HIST_NR; i++)
+		debugfs_create_file(short_hist_names[i], 0444, short_debugfs,
+				(void *)i, &short_hist_fops);
+}
+
+#ifdef SHORT_DEBUG
+/*
+ * /proc/shortbench: what recording one interrupt costs the handler,
+ * text against binary. Each read runs the loops with interrupts off,
+ * on private buffers, so the live ones are not disturbed.
+ */
+#define SHORT_BENCH_LOOPS 10000
+
+static int short_bench_show(struct seq_file *s, void *v)
+{
+	struct short_ring_head head = { };
+	struct short_ring ring = { .h = &head };
+	char text[32];
+	unsigned long flags;
+	u64 key;
+	cycles_t c0, ctext, cbin;
+	u64 t0, ntext, nbin;
+	int i;
+
+	ring.rec = (void *)__get_free_pages(GFP_KERNEL, SHORT_RING_ORDER);
+	if (!ring.rec)
+		return -ENOMEM;
+
+	local_irq_save(flags);
+	t0 = ktime_get_ns();
+	c0 = get_cycles();
+	for (i = 0; i < SHORT_BENCH_LOOPS; i++)
+		short_text_record(text, &key);
+	ctext = get_cycles() - c0;
+	ntext = ktime_get_ns() - t0;
+
+	t0 = ktime_get_ns();
+	c0 = get_cycles();
+	for (i = 0; i < SHORT_BENCH_LOOPS; i++) {
+		short_bin_record(&ring, 0);
+		head.tail = head.head; /* never full */
+	}
+	cbin = get_cycles() - c0;
+	nbin = ktime_get_ns() - t0;
+	local_irq_restore(flags);
+
+	/* get_cycles() is 0 where there is no cycle counter */
+	seq_printf(s, "text:   %llu cycles/irq, %llu ns/irq\n",
+			div_u64(ctext, SHORT_BENCH_LOOPS),
+			div_u64(ntext, SHORT_BENCH_LOOPS));
+	seq_printf(s, "binary: %llu cycles/irq, %llu ns/irq\n",
+			div_u64(cbin, SHORT_BENCH_LOOPS),
+			div_u64(nbin, SHORT_BENCH_LOOPS));
+	free_pages((unsigned long)ring.rec, SHORT_RING_ORDER);
+	return 0;
+}
+
+static int short_bench_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, short_bench_show, NULL);
+}
+
+static struct file_operations short_bench_ops = {
+	.owner	 = THIS_MODULE,
+	.open	 = short_bench_open,
+	.read	 = seq_read,
+	.llseek	 = seq_lseek,
+	.release = single_release
+};
+#endif /* SHORT_DEBUG */
+
 /* Finally, init and cleanup */
 
 int short_init(void)
@@ -571,16 +1489,35 @@ int short_init(void)
 	}
 	if (major == 0) major = result; /* dynamic */
 
-	short_buffer = __get_free_pages(GFP_KERNEL,0); /* never fails */  /* FIXME */
-	short_head = short_tail = short_buffer;
+
+	if (tvsize < 2)
+		tvsize = 2;
+	tv_mask = roundup_pow_of_two(tvsize) - 1;
+	tv_data = kmalloc_array(tv_mask + 1, sizeof(*tv_data), GFP_KERNEL);
+	if (!tv_data || short_alloc_text() || (binary && short_alloc_rings())) {
+		kfree(tv_data);
+		short_free_rings();
+		short_free_text();
+		unregister_chrdev(major, "short");
+		release_region(short_base,SHORT_NR_PORTS);  /* FIXME - use-mem case? */
+		return -ENOMEM;
+	}
+	proc_create("shortstat", 0, NULL, &short_stat_ops);
+	short_create_debugfs();
+#ifdef SHORT_DEBUG
+	proc_create("shortbench", 0, NULL, &short_bench_ops);
+#endif
 
 	/*
 	 * Fill the workqueue structure, used for the bottom half handler.
-	 * The cast is there to prevent warnings about the type of the
-	 * (unused) argument.
 	 */
 	/* this line is in short_init() */
-	INIT_WORK(&short_wq, (void (*)(void *)) short_do_tasklet);
+	INIT_WORK(&short_wq, short_do_work);
+
+	hrtimer_init(&short_poll_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	short_poll_timer.function = short_poll_tick;
+	if (poll_us < 1)
+		poll_us = 1;
 
 	/*
 	 * Now we deal with the interrupt: either kernel-based
@@ -606,6 +1543,7 @@ int short_init(void)
 	 * force short_irq to -1.
 	 */
 	if (short_irq >= 0 && share > 0) {
+		poll_rate = 0; /* others use the line: never disable it */
 		result = request_irq(short_irq, short_sh_interrupt,
 				IRQF_SHARED,"short",
 				short_sh_interrupt);
@@ -636,12 +1574,17 @@ int short_init(void)
 	 * Ok, now change the interrupt handler if using top/bottom halves
 	 * has been requested
 	 */
-	if (short_irq >= 0 && (wq + tasklet) > 0) {
+	if (short_irq >= 0 && (wq + tasklet + threaded) > 0) {
 		free_irq(short_irq,NULL);
-		result = request_irq(short_irq,
-				tasklet ? short_tl_interrupt :
-				short_wq_interrupt,
-				0,"short-bh", NULL);
+		if (threaded)
+			result = request_threaded_irq(short_irq,
+					short_th_interrupt, short_thread_fn,
+					0, "short-thread", NULL);
+		else
+			result = request_irq(short_irq,
+					tasklet ? short_tl_interrupt :
+					short_wq_interrupt,
+					0,"short-bh", NULL);
 		if (result) {
 			printk(KERN_INFO "short-bh: can't get assigned irq %i\n",
 					short_irq);
@@ -654,6 +1597,14 @@ int short_init(void)
 
 void short_cleanup(void)
 {
+	remove_proc_entry("shortstat", NULL);
+	debugfs_remove_recursive(short_debugfs);
+#ifdef SHORT_DEBUG
+	remove_proc_entry("shortbench", NULL);
+#endif
+	hrtimer_cancel(&short_poll_timer);
+	if (short_polling)
+		enable_irq(short_irq); /* keep the disable depth balanced */
 	if (short_irq >= 0) {
 		outb(0x0, short_base + 2);   /* disable the interrupt */
 		if (!share) free_irq(short_irq, NULL);
@@ -671,7 +1622,9 @@ void short_cleanup(void)
 	} else {
 		release_region(short_base,SHORT_NR_PORTS);
 	}
-	if (short_buffer) free_page(short_buffer);
+	short_free_text();
+	kfree(tv_data);
+	short_free_rings();
 }
 
 module_init(short_init);
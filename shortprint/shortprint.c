@@ -27,7 +27,8 @@
 #include <linux/ioport.h>
 #include <linux/interrupt.h>
 #include <linux/workqueue.h>
-#include <linux/timer.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
 #include <linux/poll.h>
 
 #include <asm/io.h>
@@ -60,6 +61,22 @@ static int delay = 0;
 static int shortp_delay;
 module_param(delay, int, 0);
 
+/*
+ * Burst mode: bytes strobed out per run of the work function, at most.
+ * With 1 (the default) every byte waits for its own interrupt; with
+ * more, the work function keeps going while the printer is ready and
+ * only stops when it reports busy, the queue empties or the budget is
+ * spent. The burst runs with the spinlock held and interrupts off,
+ * so keep it reasonable: shortp_delay is paid twice per byte.
+ */
+static int burst = 1;
+module_param(burst, int, 0);
+
+/* How long output may stall before we suspect a lost interrupt, in ns */
+#define WATCHDOG_NS (5ULL * NSEC_PER_SEC)  /* Wait a long time */
+static unsigned long long watchdog_ns = WATCHDOG_NS; /* 64 bits on 32-bit too */
+module_param(watchdog_ns, ullong, 0);
+
 MODULE_AUTHOR ("Jonathan Corbet");
 MODULE_LICENSE("Dual BSD/GPL");
 
@@ -67,7 +84,7 @@ MODULE_LICENSE("Dual BSD/GPL");
  * Forwards.
  */
 static void shortp_cleanup(void);
-static void shortp_timeout(unsigned long unused);
+static enum hrtimer_restart shortp_timeout(struct hrtimer *timer);
 
 /*
  * Input is managed through a simple circular buffer which, among other things,
@@ -123,6 +140,16 @@ static inline int shortp_out_space(void)
 		return (shortp_out_tail - shortp_out_head) - 1;
 }
 
+/*
+ * Total free space in the output buffer, wrap or no wrap; one byte is
+ * always left unused to tell a full buffer from an empty one.
+ */
+static inline int shortp_out_free(void)
+{
+	return PAGE_SIZE - 1 - (PAGE_SIZE + shortp_out_head - shortp_out_tail)
+			% PAGE_SIZE;
+}
+
 static inline void shortp_incr_out_bp(volatile unsigned char **bp, int incr)
 {
 	unsigned char *new = (unsigned char *) *bp + incr;
@@ -142,10 +169,21 @@ DECLARE_WAIT_QUEUE_HEAD(shortp_empty_queue); /* waked when queue empties */
 
 /*
  * When output is active, the timer is too, in case we miss interrupts.	 Hold
- * shortp_out_lock if you mess with the timer.
+ * shortp_out_lock if you mess with the timer. It is armed when output
+ * starts and left alone after that: each byte only notes the time, and
+ * when the timer fires early because bytes kept flowing it just moves
+ * itself to watchdog_ns after the last one. It isn't stopped either
+ * when output ends, it finds out and goes away by itself.
+ *
+ * shortp_timer_armed says, under the lock, whether the timer is still
+ * going (queued, or running and about to restart). Output that starts
+ * again while it is just leaves it alone: starting it then could race
+ * with a callback that is about to move it, and the timer would be
+ * moved while queued.
  */
-static struct timer_list shortp_timer;
-#define TIMEOUT 5*HZ  /* Wait a long time */
+static struct hrtimer shortp_timer;
+static int shortp_timer_armed;
+static ktime_t shortp_last_byte;	/* when output last made progress */
 
 
 /*
@@ -161,16 +199,66 @@ static int shortp_release(struct inode *inode, struct file *filp)
 {
 	/* Wait for any pending output to complete */
 	/* When the shortp_output_active equals zero then the buffer output is ok */
-	wait_event_interruptible(shortp_empty_queue, shortp_output_active==0);
+	/* Non-blocking users don't wait: the data goes out all the same */
+	if (!(filp->f_flags & O_NONBLOCK))
+		wait_event_interruptible(shortp_empty_queue, shortp_output_active==0);
 
 	return 0;
 }
 
 
 
+/*
+ * Readable when there's timing information, writable when the output
+ * buffer has more than SP_MIN_SPACE free: that's when the work
+ * function wakes up writers too, so a poller doesn't spin for a few
+ * bytes at a time.
+ */
 static unsigned int shortp_poll(struct file *filp, poll_table *wait)
 {
-    return POLLIN | POLLRDNORM | POLLOUT | POLLWRNORM;
+	unsigned int mask = 0;
+
+	poll_wait(filp, &shortp_in_queue, wait);
+	poll_wait(filp, &shortp_out_queue, wait);
+	if (shortp_in_head != shortp_in_tail)
+		mask |= POLLIN | POLLRDNORM;
+	if (shortp_out_free() > SP_MIN_SPACE)
+		mask |= POLLOUT | POLLWRNORM;
+	return mask;
+}
+
+
+/*
+ * Wait for the output queue to drain, for fsync and the ioctl.
+ */
+static int shortp_drain(struct file *filp)
+{
+	if (!shortp_output_active)
+		return 0;
+	if (filp->f_flags & O_NONBLOCK)
+		return -EAGAIN;
+	if (wait_event_interruptible(shortp_empty_queue, shortp_output_active==0))
+		return -ERESTARTSYS;
+	return 0;
+}
+
+static int shortp_fsync(struct file *filp, loff_t start, loff_t end,
+		int datasync)
+{
+	return shortp_drain(filp);
+}
+
+static long shortp_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	if (_IOC_TYPE(cmd) != SHORTP_IOC_MAGIC) return -ENOTTY;
+	if (_IOC_NR(cmd) > SHORTP_IOC_MAXNR) return -ENOTTY;
+
+	switch(cmd) {
+	    case SHORTP_IOCDRAIN:
+		return shortp_drain(filp);
+	    default:  /* redundant, as cmd was checked against MAXNR */
+		return -ENOTTY;
+	}
 }
 
 
@@ -185,6 +273,8 @@ static ssize_t shortp_read(struct file *filp, char __user *buf, size_t count, lo
 	DEFINE_WAIT(wait);
 
 	while (shortp_in_head == shortp_in_tail) {
+		if (filp->f_flags & O_NONBLOCK)
+			return -EAGAIN;
 		prepare_to_wait(&shortp_in_queue, &wait, TASK_INTERRUPTIBLE);
 		if (shortp_in_head == shortp_in_tail)
 			schedule();
@@ -223,6 +313,16 @@ static void shortp_wait(void)
 }
 
 
+/*
+ * Is the printer ready for another byte? The BUSY status line is
+ * inverted: the bit is set when the printer is *not* busy.
+ */
+static inline int shortp_ready(void)
+{
+	return inb(shortp_base + SP_STATUS) & SP_SR_BUSY;
+}
+
+
 /*
  * Write the next character from the buffer.  There should *be* a next
  * character...	 The spinlock should be held when this routine is called.
@@ -231,8 +331,8 @@ static void shortp_do_write(void)
 {
 	unsigned char cr = inb(shortp_base + SP_CONTROL);
 
-	/* Something happened; reset the timer */
-	mod_timer(&shortp_timer, jiffies + TIMEOUT);
+	/* Something happened; the timer will see it */
+	shortp_last_byte = ktime_get();
 
 	/* Strobe a byte out to the device */
 	outb_p(*shortp_out_tail, shortp_base+SP_DATA);
@@ -256,8 +356,12 @@ static void shortp_start_output(void)
 
 	/* Set up our 'missed interrupt' timer */
 	shortp_output_active = 1;
-	shortp_timer.expires = jiffies + TIMEOUT;
-	add_timer(&shortp_timer);
+	shortp_last_byte = ktime_get(); /* a live timer waits from here */
+	if (!shortp_timer_armed) {
+		shortp_timer_armed = 1;
+		hrtimer_start(&shortp_timer, ns_to_ktime(watchdog_ns),
+				HRTIMER_MODE_REL);
+	}
 
 	/*  And get the process going. */
 	queue_work(shortp_workqueue, &shortp_work);
@@ -275,9 +379,12 @@ static ssize_t shortp_write(struct file *filp, const char __user *buf, size_t co
 	/*
 	 * Take and hold the semaphore for the entire duration of the operation.  The
 	 * consumer side ignores it, and it will keep other data from interleaving
-	 * with ours.
+	 * with ours. Non-blocking writers don't wait for it either.
 	 */
-	if (down_interruptible(&shortp_out_sem))
+	if (filp->f_flags & O_NONBLOCK) {
+		if (down_trylock(&shortp_out_sem))
+			return -EAGAIN;
+	} else if (down_interruptible(&shortp_out_sem))
 		return -ERESTARTSYS;
 	/*
 	 * Out with the data.
@@ -286,10 +393,19 @@ static ssize_t shortp_write(struct file *filp, const char __user *buf, size_t co
 		/* Hang out until some buffer space is available. */
 		space = shortp_out_space();
 		if (space <= 0) {
+			/* Full: take what fit, or tell a non-blocking writer */
+			if (filp->f_flags & O_NONBLOCK) {
+				if (!written)
+					written = -EAGAIN;
+				goto out;
+			}
 			/* wait_event_interruptible return zero indicates success */
 			if (wait_event_interruptible(shortp_out_queue,
-					    (space = shortp_out_space()) > 0))
+					    (space = shortp_out_space()) > 0)) {
+				if (!written)
+					written = -ERESTARTSYS;
 				goto out;
+			}
 		}
 
 		/* Move data into the buffer. */
@@ -311,7 +427,8 @@ static ssize_t shortp_write(struct file *filp, const char __user *buf, size_t co
 	}
 
 out:
-	*f_pos += written;
+	if (written > 0)
+		*f_pos += written;
 	up(&shortp_out_sem);
 	return written;
 }
@@ -324,7 +441,7 @@ out:
 
 static void shortp_do_work(void *unused)
 {
-	int written;
+	int written, n;
 	unsigned long flags;
 
 	/* Wait until the device is ready */
@@ -336,14 +453,22 @@ static void shortp_do_work(void *unused)
 	if (shortp_out_head == shortp_out_tail) { /* empty */
 		shortp_output_active = 0;
 		wake_up_interruptible(&shortp_empty_queue);
-		del_timer(&shortp_timer);  
+		/* the timer notices by itself */
 	}
-	/* Nope, write another byte */
-	else
+	/*
+	 * Nope, write another byte, and more while the printer takes them
+	 * if bursting. The interrupts for the extra bytes just queue the
+	 * work once more, to find the queue empty or the printer ready.
+	 */
+	else {
 		shortp_do_write();
+		for (n = 1; n < burst && shortp_out_head != shortp_out_tail &&
+				shortp_ready(); n++)
+			shortp_do_write();
+	}
 
 	/* If somebody's waiting, maybe wake them up. */
-	if (((PAGE_SIZE + shortp_out_tail - shortp_out_head) % PAGE_SIZE) > SP_MIN_SPACE) {
+	if (shortp_out_free() > SP_MIN_SPACE) {
 		wake_up_interruptible(&shortp_out_queue);
 	}
 	spin_unlock_irqrestore(&shortp_out_lock, flags);
@@ -376,27 +501,39 @@ static irqreturn_t shortp_interrupt(int irq, void *dev_id, struct pt_regs *regs)
  * things have gone wrong, however; printers can spend an awful long time
  * just thinking about things.
  */
-static void shortp_timeout(unsigned long unused)
+static enum hrtimer_restart shortp_timeout(struct hrtimer *timer)
 {
 	unsigned long flags;
 	unsigned char status;
-   
-	if (! shortp_output_active)
-		return;
+	ktime_t due;
+
 	spin_lock_irqsave(&shortp_out_lock, flags);
+	if (! shortp_output_active) {
+		shortp_timer_armed = 0; /* the next start_output starts it */
+		spin_unlock_irqrestore(&shortp_out_lock, flags);
+		return HRTIMER_NORESTART;
+	}
+
+	/* Bytes went out since we were armed: wait from the last one */
+	due = ktime_add_ns(shortp_last_byte, watchdog_ns);
+	if (ktime_before(ktime_get(), due)) {
+		hrtimer_set_expires(timer, due);
+		spin_unlock_irqrestore(&shortp_out_lock, flags);
+		return HRTIMER_RESTART;
+	}
+	hrtimer_forward_now(timer, ns_to_ktime(watchdog_ns));
 	status = inb(shortp_base + SP_STATUS);
 
 	/* If the printer is still busy we just reset the timer */
 	if ((status & SP_SR_BUSY) == 0 || (status & SP_SR_ACK)) {
-		shortp_timer.expires = jiffies + TIMEOUT;
-		add_timer(&shortp_timer);
 		spin_unlock_irqrestore(&shortp_out_lock, flags);
-		return;
+		return HRTIMER_RESTART;
 	}
 
 	/* Otherwise we must have dropped an interrupt. */
 	spin_unlock_irqrestore(&shortp_out_lock, flags);
 	shortp_interrupt(shortp_irq, NULL, NULL);
+	return HRTIMER_RESTART; /* and keep watching */
 }
     
 
@@ -409,6 +546,8 @@ static struct file_operations shortp_fops = {
 	.open =	   shortp_open,
 	.release = shortp_release,
 	.poll =	   shortp_poll,
+	.fsync =   shortp_fsync,
+	.unlocked_ioctl = shortp_ioctl,
 	.owner	 = THIS_MODULE
 };
 
@@ -431,6 +570,8 @@ static int shortp_init(void)
 	shortp_base = base;
 	shortp_irq = irq;
 	shortp_delay = delay;
+	if (!watchdog_ns)
+		watchdog_ns = WATCHDOG_NS;
 
 	/* Get our needed resources. */
 	if (! request_region(shortp_base, SHORTP_NR_PORTS, "shortprint")) {
@@ -461,8 +602,8 @@ static int shortp_init(void)
 	/* And the output info */
 	shortp_output_active = 0;
 	spin_lock_init(&shortp_out_lock);
-	timer_setup(&shortp_timer, shortp_timeout, 0);
-	//shortp_timer.data = 0;
+	hrtimer_init(&shortp_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	shortp_timer.function = shortp_timeout;
     
 	/* Set up our workqueue. */
 	shortp_workqueue = create_singlethread_workqueue("shortprint");
@@ -505,8 +646,8 @@ static void shortp_cleanup(void)
 
 	/* Don't leave any timers floating around.  Note that any active output
 	   is effectively stopped by turning off the interrupt */
-	if (shortp_output_active)
-		del_timer_sync (&shortp_timer);
+	shortp_output_active = 0;
+	hrtimer_cancel(&shortp_timer);
 	flush_workqueue(shortp_workqueue);
 	destroy_workqueue(shortp_workqueue);
 
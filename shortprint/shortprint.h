@@ -44,3 +44,11 @@
  * Minimum space before waking up a writer.
  */
 #define SP_MIN_SPACE	PAGE_SIZE/2
+
+/*
+ * Ioctl definitions. There's only one: wait for the output queue to
+ * empty, like fsync() does (-EAGAIN with O_NONBLOCK if it isn't).
+ */
+#define SHORTP_IOC_MAGIC	'p'
+#define SHORTP_IOCDRAIN		_IO(SHORTP_IOC_MAGIC, 0)
+#define SHORTP_IOC_MAXNR	0